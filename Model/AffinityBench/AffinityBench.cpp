@@ -0,0 +1,225 @@
+// AffinityBench.cpp : Thread pool throughput and scheduling latency with the workers left to the OS, pinned
+// compact, pinned scatter or pinned to a --cpus list. Every simulated session owns a working set of --state-kb
+// bytes that each of its steps reads and writes, like a session going over its chunk and write buffers, and posts
+// its next step as soon as one is done. Prints steps/s and the percentiles of the time from post to start of a
+// step, e.g.
+//   AffinityBench --sessions 256 --state-kb 64 --seconds 10
+// Run it on a multi-socket machine: unpinned, sessions hop between cores and nodes and drag their state along.
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include "../ServerCore/ThreadPool.h"
+#include "../LoadGen/LatencyHistogram.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct BenchConfig {
+    //Workers per pool, 0 for one per processor (or per --cpus entry)
+    int threads = 0;
+    int sessions = 0;
+    int stateKb = 64;
+    int seconds = 5;
+    vector<PinMode> modes = { PinMode::None, PinMode::Compact, PinMode::Scatter };
+    vector<int> cpus;
+    bool stickySessions = true;
+};
+
+struct ModeResult {
+    string name;
+    double seconds = 0;
+    uint64_t steps = 0;
+    LatencyHistogram latency;
+};
+
+//Counters of one worker thread, merged once the pool is gone
+struct WorkerStats {
+    uint64_t steps = 0;
+    LatencyHistogram latency;
+};
+
+class AffinityRun {
+private:
+    struct Session {
+        int worker = ThreadPool::ANY_WORKER;
+        NodeBuffer state;
+        Clock::time_point posted;
+        uint64_t checksum = 0;
+    };
+
+    const BenchConfig& config;
+    size_t stateBytes;
+    vector<Session> sessions;
+    mutex stats_mutex;
+    vector<unique_ptr<WorkerStats>> stats;
+    atomic<bool> stopping{ false };
+    atomic<int> running{ 0 };
+    //Declared last so its workers are joined before the sessions and counters they use go away
+    ThreadPool pool;
+
+    WorkerStats& Stats() {
+        thread_local WorkerStats* workerStats = nullptr;
+        thread_local AffinityRun* owner = nullptr;
+        if (owner != this) {
+            lock_guard<mutex> lock(stats_mutex);
+            stats.push_back(make_unique<WorkerStats>());
+            workerStats = stats.back().get();
+            owner = this;
+        }
+        return *workerStats;
+    }
+
+    void Step(int index) {
+        Session& session = sessions[index];
+        WorkerStats& workerStats = Stats();
+        workerStats.latency.Record(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - session.posted).count());
+        workerStats.steps++;
+
+        //The first step allocates the state on the node of the worker the session is bound to
+        if (session.state.data() == nullptr) {
+            session.state = NodeBuffer(stateBytes, pool.CurrentNode());
+            memset(session.state.data(), 0, stateBytes);
+        }
+        uint64_t* words = reinterpret_cast<uint64_t*>(session.state.data());
+        for (size_t i = 0; i < stateBytes / sizeof(uint64_t); i++) {
+            words[i] += i;
+            session.checksum ^= words[i];
+        }
+
+        if (stopping) {
+            running--;
+            return;
+        }
+        Post(index);
+    }
+
+    void Post(int index) {
+        Session& session = sessions[index];
+        session.posted = Clock::now();
+        pool.Post(TaskPriority::Interactive, [this, index]() { Step(index); }, session.worker);
+    }
+
+public:
+    AffinityRun(const BenchConfig& benchConfig, int threads, WorkerPlacement placement)
+        : config(benchConfig), stateBytes(size_t(benchConfig.stateKb) * 1024) {
+        pool.SetTaskTracing(false);
+        pool.Start(threads, placement);
+    }
+
+    ModeResult Run(const string& name) {
+        int sessionCount = config.sessions > 0 ? config.sessions : 4 * static_cast<int>(thread::hardware_concurrency());
+        sessions.resize(sessionCount);
+        for (Session& session : sessions) {
+            session.worker = pool.AcquireWorker();
+        }
+
+        running = sessionCount;
+        auto start = Clock::now();
+        for (int i = 0; i < sessionCount; i++) {
+            Post(i);
+        }
+        this_thread::sleep_for(chrono::seconds(config.seconds));
+        stopping = true;
+        chrono::duration<double> elapsed = Clock::now() - start;
+        while (running > 0) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+
+        ModeResult result;
+        result.name = name;
+        result.seconds = elapsed.count();
+        lock_guard<mutex> lock(stats_mutex);
+        for (const auto& workerStats : stats) {
+            result.steps += workerStats->steps;
+            result.latency.Merge(workerStats->latency);
+        }
+        return result;
+    }
+};
+
+static bool parseModes(const string& text, vector<PinMode>& modes) {
+    modes.clear();
+    size_t position = 0;
+    while (position <= text.size()) {
+        size_t end = text.find(',', position);
+        string item = text.substr(position, end == string::npos ? string::npos : end - position);
+        PinMode mode;
+        if (!parsePinMode(item.c_str(), mode)) {
+            return false;
+        }
+        modes.push_back(mode);
+        if (end == string::npos) {
+            break;
+        }
+        position = end + 1;
+    }
+    return !modes.empty();
+}
+
+int main(int argc, char* argv[])
+{
+    BenchConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--threads") == 0) config.threads = max(0, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "--sessions") == 0) config.sessions = max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "--state-kb") == 0) config.stateKb = max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "--seconds") == 0) config.seconds = max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "--sticky-sessions") == 0) config.stickySessions = atoi(argv[i + 1]) != 0;
+        else if (strcmp(argv[i], "--modes") == 0 && !parseModes(argv[i + 1], config.modes)) {
+            cout << "Bad --modes " << argv[i + 1] << ", expected e.g. none,compact,scatter" << endl;
+            return 1;
+        }
+        else if (strcmp(argv[i], "--cpus") == 0 && !parseCpuList(argv[i + 1], config.cpus)) {
+            cout << "Bad --cpus list " << argv[i + 1] << ", expected e.g. 0,2,4-7" << endl;
+            return 1;
+        }
+    }
+    if (!config.cpus.empty()) {
+        config.modes.push_back(PinMode::List);
+    }
+
+    vector<LogicalCpu> topology = cpuTopology();
+    int cores = 0, nodes = 0;
+    for (const LogicalCpu& cpu : topology) {
+        cores = max(cores, cpu.core + 1);
+        nodes = max(nodes, cpu.node + 1);
+    }
+    cout << topology.size() << " processors, " << cores << " cores, " << nodes << " NUMA nodes" << endl;
+
+    vector<ModeResult> results;
+    for (PinMode mode : config.modes) {
+        WorkerPlacement placement;
+        placement.mode = mode;
+        placement.cpus = config.cpus;
+        placement.stickySessions = config.stickySessions;
+        AffinityRun run(config, config.threads, placement);
+        results.push_back(run.Run(pinModeName(mode)));
+    }
+
+    cout << config.stateKb << " KB of state per session, sticky sessions " << (config.stickySessions ? "on" : "off") << endl;
+    cout << left << setw(10) << "mode" << right << setw(14) << "steps/s" << setw(10) << "GB/s" << setw(12) << "p50 us"
+        << setw(12) << "p99 us" << setw(12) << "p99.9 us" << endl;
+    for (const ModeResult& result : results) {
+        double stepsPerSecond = result.steps / result.seconds;
+        cout << left << setw(10) << result.name << right << fixed << setprecision(0) << setw(14) << stepsPerSecond
+            << setprecision(2) << setw(10) << stepsPerSecond * config.stateKb / (1024.0 * 1024.0)
+            << setprecision(1) << setw(12) << result.latency.ValueAtPercentile(50) / 1000.0
+            << setw(12) << result.latency.ValueAtPercentile(99) / 1000.0
+            << setw(12) << result.latency.ValueAtPercentile(99.9) / 1000.0 << endl;
+    }
+    for (size_t i = 1; i < results.size(); i++) {
+        if (results[0].name == "none") {
+            cout << results[i].name << " vs none: steps/s x" << setprecision(2)
+                << (results[i].steps / results[i].seconds) / (results[0].steps / results[0].seconds) << endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,190 @@
+// BatchBench.cpp : Small file upload rate with one SEND per file against a single pipelined BTCH for all of them.
+// Creates --files files of --file-bytes bytes under --dir (kept for later runs), uploads them both ways and prints
+// files/sec. Start the server first, then e.g.
+//   BatchBench --files 20000 --file-bytes 2048 --readers 4
+// --corrupt-every N damages every Nth batch frame to check that the server asks for the frames again.
+#define WIN32_LEAN_AND_MEAN
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <filesystem>
+#include "../Client/ClientProtocol.h"
+#include "../Client/BatchUpload.h"
+
+using namespace std;
+
+struct BenchConfig {
+    int port = 55555;
+    int files = 5000;
+    int fileBytes = 2048;
+    int readers = BATCH_READER_THREADS;
+    int corruptEvery = 0;
+    string directory = "batchbench_files";
+    string mode = "both";
+};
+
+struct ModeResult {
+    string name;
+    uint32_t files = 0;
+    uint32_t failed = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    uint32_t framesResent = 0;
+};
+
+//Writes the test files unless a previous run left the same set behind
+static bool prepareFiles(const BenchConfig& config, vector<BatchFileEntry>& files) {
+    files = listBatchFiles(config.directory);
+    bool reusable = files.size() == static_cast<size_t>(config.files) &&
+        all_of(files.begin(), files.end(), [&](const BatchFileEntry& file) { return file.size == uint64_t(config.fileBytes); });
+    if (reusable) {
+        return true;
+    }
+
+    error_code error;
+    filesystem::remove_all(config.directory, error);
+    vector<char> content(config.fileBytes);
+    for (int i = 0; i < config.files; i++) {
+        //A hundred files per directory, like a source tree rather than one flat folder
+        filesystem::path directory = filesystem::path(config.directory) / to_string(i / 100);
+        filesystem::create_directories(directory, error);
+        for (int j = 0; j < config.fileBytes; j++) {
+            content[j] = static_cast<char>(i + j);
+        }
+        ofstream file(directory / (to_string(i) + ".dat"), ios::binary);
+        if (!file.write(content.data(), content.size())) {
+            cout << "Can't write test files under " << config.directory << endl;
+            return false;
+        }
+    }
+    files = listBatchFiles(config.directory);
+    return true;
+}
+
+//The way Client.cpp sends a file, once per file: request, header, checksummed chunks, confirmation
+static bool runSends(SOCKET clientSocket, const vector<BatchFileEntry>& files, uint64_t secret, ModeResult& result) {
+    SocketTransport transport{ clientSocket };
+    char recieveConf[32];
+    vector<char> content;
+
+    auto start = chrono::steady_clock::now();
+    for (const BatchFileEntry& entry : files) {
+        ifstream file(entry.path, ios::binary);
+        content.resize(entry.size);
+        if (!file.read(content.data(), content.size())) {
+            result.failed++;
+            continue;
+        }
+        auto readChunk = [&](uint32_t index, char* chunkBuffer) {
+            int chunkBytes = static_cast<int>(min<uint64_t>(entry.size - uint64_t(index) * CHUNK_SIZE, CHUNK_SIZE));
+            memcpy(chunkBuffer, content.data() + uint64_t(index) * CHUNK_SIZE, chunkBytes);
+            return chunkBytes;
+        };
+        if (!sendRequest(clientSocket, "SEND", recieveConf) || !sendFileHeader(clientSocket, entry.size, "dat") ||
+            !sendFileBody(transport, entry.size, readChunk, secret) || !recvAll(clientSocket, recieveConf, 32)) {
+            return false;
+        }
+        result.files++;
+        result.bytes += entry.size;
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+    return true;
+}
+
+static bool runBatch(SOCKET clientSocket, const vector<BatchFileEntry>& files, uint64_t secret,
+    const BenchConfig& config, ModeResult& result) {
+    char recieveConf[32];
+    auto start = chrono::steady_clock::now();
+    if (!sendRequest(clientSocket, "BTCH", recieveConf)) {
+        return false;
+    }
+    SocketTransport socketTransport{ clientSocket };
+    CorruptingTransport<SocketTransport> transport{ socketTransport, config.corruptEvery };
+    BatchUploader<CorruptingTransport<SocketTransport>> uploader(transport, files, secret);
+    BatchResult batch = uploader.Run(config.readers);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    result.files = batch.filesWritten;
+    result.failed = batch.filesFailed;
+    result.bytes = batch.bytesWritten;
+    result.seconds = elapsed.count();
+    result.framesResent = batch.framesResent;
+    return batch.completed;
+}
+
+static bool runMode(const BenchConfig& config, const vector<BatchFileEntry>& files, bool batch, ModeResult& result) {
+    result.name = batch ? "batch" : "send";
+    uint64_t secret;
+    SOCKET clientSocket = connectToServer(config.port);
+    if (clientSocket == INVALID_SOCKET || !clientHandshake(clientSocket, secret)) {
+        cout << "Can't connect to the server " << WSAGetLastError() << endl;
+        return false;
+    }
+    bool completed = batch ? runBatch(clientSocket, files, secret, config, result)
+        : runSends(clientSocket, files, secret, result);
+    if (!completed) {
+        cout << result.name << " session failed " << WSAGetLastError() << endl;
+    }
+    else {
+        send(clientSocket, "STOP", 4, 0);
+    }
+    closesocket(clientSocket);
+    return completed;
+}
+
+int main(int argc, char* argv[])
+{
+    BenchConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--port") == 0) config.port = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--files") == 0) config.files = max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "--file-bytes") == 0) config.fileBytes = max(0, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "--readers") == 0) config.readers = max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "--corrupt-every") == 0) config.corruptEvery = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--dir") == 0) config.directory = argv[i + 1];
+        else if (strcmp(argv[i], "--mode") == 0) config.mode = argv[i + 1];
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cout << "Winsock dll not found" << endl;
+        return 0;
+    }
+
+    vector<BatchFileEntry> files;
+    if (!prepareFiles(config, files)) {
+        WSACleanup();
+        return 1;
+    }
+
+    vector<ModeResult> results;
+    for (bool batch : { false, true }) {
+        if (config.mode != "both" && config.mode != (batch ? "batch" : "send")) {
+            continue;
+        }
+        ModeResult result;
+        if (runMode(config, files, batch, result)) {
+            results.push_back(result);
+        }
+    }
+
+    cout << files.size() << " files of " << config.fileBytes << " bytes, " << config.readers << " batch readers" << endl;
+    cout << left << setw(8) << "mode" << right << setw(10) << "files" << setw(8) << "failed" << setw(10) << "seconds"
+        << setw(12) << "files/s" << setw(10) << "MB/s" << setw(10) << "resent" << endl;
+    for (const ModeResult& result : results) {
+        cout << left << setw(8) << result.name << right << setw(10) << result.files << setw(8) << result.failed
+            << fixed << setprecision(2) << setw(10) << result.seconds << setprecision(1)
+            << setw(12) << result.files / result.seconds << setw(10) << result.bytes / (1024.0 * 1024.0) / result.seconds
+            << setw(10) << result.framesResent << endl;
+    }
+    if (results.size() == 2) {
+        cout << "batch vs send: files/s x" << (results[1].files / results[1].seconds) / (results[0].files / results[0].seconds) << endl;
+    }
+
+    WSACleanup();
+    return 0;
+}
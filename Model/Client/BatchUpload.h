@@ -0,0 +1,299 @@
+// BatchUpload.h : Client side of BTCH, the batch upload of many files or a whole directory (wire format in
+// ServerCore/BatchProtocol.h). Reader threads open and read the files, pack them into frames and checksum and
+// encrypt those; the calling thread sends the frames and a second thread reads the server's acknowledgements.
+// Reading, sending and the server's writes all overlap, and no file waits for the one before it to be confirmed.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ClientProtocol.h"
+#include "../ServerCore/BatchProtocol.h"
+
+//Threads reading files for a batch unless the caller picks another number
+const int BATCH_READER_THREADS = 4;
+//A file whose first piece would get less room than this (or than the whole file) goes into the next frame
+const uint32_t BATCH_MIN_PIECE = 4096;
+
+struct BatchFileEntry {
+    //Where the client reads the file
+    std::string path;
+    //Name under the server's batch directory, '/' separated
+    std::string relativePath;
+    uint64_t size;
+};
+
+struct BatchResult {
+    bool completed = false;
+    uint32_t filesWritten = 0;
+    //Files the client couldn't read or the server couldn't write
+    uint32_t filesFailed = 0;
+    uint64_t bytesWritten = 0;
+    uint32_t framesSent = 0;
+    uint32_t framesResent = 0;
+    double seconds = 0;
+};
+
+//Regular files below root, or root itself if it is a file. Names are relative to root's parent, so the
+//directory itself is recreated on the server.
+inline std::vector<BatchFileEntry> listBatchFiles(const std::string& root) {
+    namespace fs = std::filesystem;
+    std::vector<BatchFileEntry> files;
+    std::error_code error;
+    fs::path rootPath = fs::path(root).lexically_normal();
+    if (!rootPath.has_filename()) {
+        rootPath = rootPath.parent_path();
+    }
+    fs::path base = rootPath.parent_path();
+
+    auto add = [&](const fs::path& path) {
+        uint64_t size = fs::file_size(path, error);
+        if (!error) {
+            files.push_back({ path.string(), path.lexically_relative(base).generic_string(), size });
+        }
+    };
+    if (fs::is_regular_file(rootPath, error)) {
+        add(rootPath);
+        return files;
+    }
+    for (fs::recursive_directory_iterator it(rootPath, error), end; !error && it != end; it.increment(error)) {
+        if (it->is_regular_file(error)) {
+            add(it->path());
+        }
+    }
+    return files;
+}
+
+//One BTCH request over a transport whose SendAll and RecvAll may run on different threads at once. Send "BTCH"
+//and wait for its confirmation first, then Run().
+template<typename Transport>
+class BatchUploader {
+private:
+    using Frame = std::shared_ptr<std::vector<char>>;
+
+    Transport& transport;
+    const std::vector<BatchFileEntry>& files;
+    uint64_t secret;
+    std::atomic<uint32_t> nextFile{ 0 };
+
+    std::mutex pipeline_mutex;
+    std::condition_variable changed;
+    //Frames packed by the readers, not sent yet
+    std::deque<Frame> ready;
+    //Frames sent but not acknowledged, the first one has sequence firstInFlight
+    std::deque<Frame> inFlight;
+    uint32_t firstInFlight = 0;
+    uint32_t nextSequence = 0;
+    uint32_t resendFrom = BATCH_NO_RESEND;
+    int readersRunning = 0;
+    bool endSent = false;
+    bool finished = false;
+    bool failed = false;
+    BatchResult result;
+
+    static Frame NewFrame() {
+        return std::make_shared<std::vector<char>>(sizeof(BatchFrameHeader) + BATCH_FRAME_SIZE);
+    }
+
+    //Checksums and encrypts the payload and queues the frame for the sender, waiting while a window's worth of
+    //frames is already queued. False once the batch has failed.
+    bool QueueFrame(Frame& frame, uint32_t payloadBytes) {
+        char* payload = frame->data() + sizeof(BatchFrameHeader);
+        BatchFrameHeader header{ 0, payloadBytes, crc32c(payload, payloadBytes) };
+        encrypt(payload, payloadBytes, secret);
+        memcpy(frame->data(), &header, sizeof(header));
+        frame->resize(sizeof(header) + payloadBytes);
+
+        std::unique_lock<std::mutex> lock(pipeline_mutex);
+        changed.wait(lock, [this]() { return ready.size() < BATCH_WINDOW_FRAMES || failed; });
+        if (failed) {
+            return false;
+        }
+        ready.push_back(frame);
+        changed.notify_all();
+        frame = NewFrame();
+        return true;
+    }
+
+    void Reader() {
+        Frame frame = NewFrame();
+        uint32_t used = 0;
+        uint32_t index;
+        while ((index = nextFile++) < files.size()) {
+            const BatchFileEntry& entry = files[index];
+            std::ifstream file(entry.path, std::ios::binary);
+            if (!file.is_open() || entry.relativePath.size() > BATCH_MAX_PATH) {
+                std::lock_guard<std::mutex> lock(pipeline_mutex);
+                result.filesFailed++;
+                continue;
+            }
+
+            uint64_t offset = 0;
+            do {
+                uint32_t pathBytes = offset == 0 ? static_cast<uint32_t>(entry.relativePath.size()) : 0;
+                uint32_t needed = sizeof(BatchRecordHeader) + pathBytes;
+                uint64_t remaining = entry.size - offset;
+                if (BATCH_FRAME_SIZE - used < needed + std::min<uint64_t>(remaining, BATCH_MIN_PIECE)) {
+                    if (!QueueFrame(frame, used)) {
+                        return;
+                    }
+                    used = 0;
+                }
+                uint32_t length = static_cast<uint32_t>(std::min<uint64_t>(remaining, BATCH_FRAME_SIZE - used - needed));
+                char* piece = frame->data() + sizeof(BatchFrameHeader) + used;
+                if (length > 0 && !file.read(piece + needed, length)) {
+                    //Nothing of it sent yet: count it here, otherwise the server reports it incomplete
+                    if (offset == 0) {
+                        std::lock_guard<std::mutex> lock(pipeline_mutex);
+                        result.filesFailed++;
+                    }
+                    break;
+                }
+                BatchRecordHeader record{ index, static_cast<uint16_t>(pathBytes), entry.size, offset, length };
+                memcpy(piece, &record, sizeof(record));
+                memcpy(piece + sizeof(record), entry.relativePath.data(), pathBytes);
+                used += needed + length;
+                offset += length;
+            } while (offset < entry.size);
+        }
+        if (used > 0 && !QueueFrame(frame, used)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(pipeline_mutex);
+        readersRunning--;
+        changed.notify_all();
+    }
+
+    void AckReader() {
+        while (true) {
+            BatchAck ack;
+            bool received = transport.RecvAll((char*)&ack, sizeof(ack));
+            std::vector<BatchFileStatus> statuses(received ? ack.fileCount : 0);
+            received = received && (statuses.empty() ||
+                transport.RecvAll((char*)statuses.data(), static_cast<int>(statuses.size() * sizeof(BatchFileStatus))));
+
+            std::lock_guard<std::mutex> lock(pipeline_mutex);
+            if (!received) {
+                failed = true;
+                changed.notify_all();
+                return;
+            }
+            for (const BatchFileStatus& status : statuses) {
+                if (status.written && status.fileId < files.size()) {
+                    result.filesWritten++;
+                    result.bytesWritten += files[status.fileId].size;
+                }
+                else {
+                    result.filesFailed++;
+                }
+            }
+            while (firstInFlight < ack.framesReceived && !inFlight.empty()) {
+                inFlight.pop_front();
+                firstInFlight++;
+            }
+            if (ack.resendFrom != BATCH_NO_RESEND) {
+                resendFrom = ack.resendFrom;
+            }
+            finished = ack.last != 0;
+            changed.notify_all();
+            if (finished) {
+                return;
+            }
+        }
+    }
+
+    //Sends queued frames while the window has room, then the end frame, and goes back to resend when asked.
+    //Returns once the server's last acknowledgement arrived or the batch failed.
+    bool Sender() {
+        std::unique_lock<std::mutex> lock(pipeline_mutex);
+        while (true) {
+            changed.wait(lock, [this]() {
+                return failed || finished || resendFrom != BATCH_NO_RESEND ||
+                    (inFlight.size() < BATCH_WINDOW_FRAMES && (!ready.empty() || (readersRunning == 0 && !endSent)));
+                });
+            if (failed || finished) {
+                return finished;
+            }
+
+            std::vector<Frame> frames;
+            if (resendFrom != BATCH_NO_RESEND) {
+                for (size_t i = resendFrom - firstInFlight; i < inFlight.size(); i++) {
+                    frames.push_back(inFlight[i]);
+                }
+                resendFrom = BATCH_NO_RESEND;
+                result.framesResent += static_cast<uint32_t>(frames.size());
+            }
+            else {
+                Frame frame;
+                if (!ready.empty()) {
+                    frame = ready.front();
+                    ready.pop_front();
+                }
+                else {
+                    frame = std::make_shared<std::vector<char>>(sizeof(BatchFrameHeader));
+                    BatchFrameHeader end{ 0, 0, 0 };
+                    memcpy(frame->data(), &end, sizeof(end));
+                    endSent = true;
+                }
+                uint32_t sequence = nextSequence++;
+                memcpy(frame->data(), &sequence, sizeof(sequence));
+                inFlight.push_back(frame);
+                frames.push_back(frame);
+                result.framesSent++;
+                changed.notify_all();
+            }
+
+            lock.unlock();
+            bool sent = true;
+            for (const Frame& frame : frames) {
+                sent = sent && transport.SendAll(frame->data(), static_cast<int>(frame->size()));
+            }
+            lock.lock();
+            if (!sent) {
+                failed = true;
+                changed.notify_all();
+            }
+        }
+    }
+
+public:
+    BatchUploader(Transport& batchTransport, const std::vector<BatchFileEntry>& batchFiles, uint64_t key)
+        : transport(batchTransport), files(batchFiles), secret(key) {}
+
+    BatchResult Run(int readerThreads = BATCH_READER_THREADS) {
+        auto start = std::chrono::steady_clock::now();
+        readersRunning = readerThreads;
+        std::vector<std::thread> readers;
+        for (int i = 0; i < readerThreads; i++) {
+            readers.emplace_back(&BatchUploader::Reader, this);
+        }
+        std::thread acknowledgements(&BatchUploader::AckReader, this);
+
+        bool completed = Sender();
+        if (!completed) {
+            //Unblocks the acknowledgement thread, the session is over anyway
+            transport.Shutdown();
+        }
+        {
+            std::lock_guard<std::mutex> lock(pipeline_mutex);
+            failed = failed || !completed;
+            changed.notify_all();
+        }
+        for (std::thread& reader : readers) {
+            reader.join();
+        }
+        acknowledgements.join();
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        result.seconds = elapsed.count();
+        result.completed = completed;
+        return result;
+    }
+};
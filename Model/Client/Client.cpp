@@ -7,59 +7,11 @@
 #include <tchar.h>
 #include <fstream>
 #include <vector>
-#define MAX_BUFFER 1024*1024
-#define CHUNK_SIZE 1024
+#include "ClientProtocol.h"
+#include "BatchUpload.h"
 
 using namespace std;
 
-//Helpers
-bool isPrime(int num) {
-    if (num <= 1) return false;
-    for (int i = 2; i <= sqrt(num); i++) {
-        if (num % i == 0) return false;
-    }
-    return true;
-}
-
-int generateRandomPrime(int lower, int upper) {
-    if (lower > upper) swap(lower, upper);
-    vector<int> primes;
-
-    for (int i = lower; i <= upper; i++) {
-        if (isPrime(i)) {
-            primes.push_back(i);
-        }
-    }
-
-    if (primes.empty()) {
-        cout << "No prime numbers in the given range!" << endl;
-        return -1;
-    }
-
-    srand(time(0));
-    int randomIndex = rand() % primes.size();
-    return primes[randomIndex];
-}
-
-uint64_t mod_exp(uint64_t base, uint64_t exp, uint64_t mod) {
-    uint64_t result = 1;
-    base = base % mod;
-    while (exp > 0) {
-        if (exp % 2 == 1) { // If exp is odd
-            result = (result * base) % mod;
-        }
-        exp = exp >> 1; // Divide exp by 2
-        base = (base * base) % mod;
-    }
-    return result;
-}
-
-static void encrypt(char* sendBuffer, int size, uint64_t key) {
-    for (size_t i = 0; i < size; i++) {
-        sendBuffer[i] ^= (key >> (8 * (i % 8))) & 0xFF;
-    }
-}
-
 //Handlers
 void inputHandler(SOCKET clientSocket, char* recieveConf, char* requestBuffer) {
     memset(requestBuffer, 0, 8);
@@ -92,16 +44,21 @@ void inputHandler(SOCKET clientSocket, char* recieveConf, char* requestBuffer) {
 
 void chatRequestHandler(SOCKET clientSocket, char* sendBuffer, char* recieveConf, char* requestBuffer, uint64_t secret) {
     cout << "Enter your message for server" << endl;
-    cin.getline(sendBuffer, MAX_BUFFER);
+    //The message is read in behind room for its length prefix so both go out in a single send
+    char* message = sendBuffer + sizeof(uint32_t);
+    cin.getline(message, MAX_BUFFER - sizeof(uint32_t));
+
+    //Only the typed message (with its terminator) is sent, prefixed by its length
+    uint32_t messageLength = strlen(message) + 1;
 
     //Encrypt
-    encrypt(sendBuffer, MAX_BUFFER, secret);
-    
+    int frameBytes = buildChatFrame(sendBuffer, messageLength, secret);
+
     //Send returns the number of bytes sent to the server
-    auto byteCount = send(clientSocket, sendBuffer, MAX_BUFFER, 0);
+    auto byteCount = send(clientSocket, sendBuffer, frameBytes, 0);
 
     if (byteCount != SOCKET_ERROR) {
-        cout << "Client: sent " << sendBuffer << endl;
+        cout << "Client: sent " << message << endl;
     }
     else {
         cout << "Server send error " << WSAGetLastError() << endl;;
@@ -151,25 +108,25 @@ void fileRequestHandle(SOCKET clientSocket, char* recieveConf, uint64_t secret)
     streampos fileSize = file.tellg();
     file.seekg(0, ios::beg);
 
-    // Send file size first
-    send(clientSocket, reinterpret_cast<const char*>(&fileSize), sizeof(fileSize), 0);
-
-    send(clientSocket, extension, 16, 0);
-
-    //Extracts n characters from the stream and stores them in the array pointed to by s.
-    char chunkBuffer[CHUNK_SIZE];
-    
-    while (file.read(chunkBuffer, CHUNK_SIZE) || file.gcount() > 0) {
-        encrypt(chunkBuffer, CHUNK_SIZE, secret);
-        send(clientSocket, chunkBuffer, file.gcount(), 0);
-        memset(chunkBuffer, 0, sizeof(chunkBuffer));
+    // Send file size and extension first
+    sendFileHeader(clientSocket, fileSize, extension);
+
+    //Chunks are read where the server asks for them, so corrupted ones can be sent again
+    SocketTransport transport{ clientSocket };
+    auto readChunk = [&file](uint32_t index, char* chunkBuffer) {
+        file.clear();
+        file.seekg(static_cast<streamoff>(index) * CHUNK_SIZE);
+        file.read(chunkBuffer, CHUNK_SIZE);
+        return static_cast<int>(file.gcount());
+    };
+    if (!sendFileBody(transport, fileSize, readChunk, secret)) {
+        cout << "Server send error " << WSAGetLastError() << endl;
+        return;
     }
     cout << "File sent to server waiting for response......" << endl;
     file.close();
 
-    auto byteCount = recv(clientSocket, recieveConf, 32, 0);
-
-    if (byteCount == SOCKET_ERROR) {
+    if (!recvAll(clientSocket, recieveConf, 32)) {
         cout << "Server send error " << WSAGetLastError() << endl;;
         WSACleanup();
         return;
@@ -178,6 +135,28 @@ void fileRequestHandle(SOCKET clientSocket, char* recieveConf, uint64_t secret)
     cout << "Server: " << recieveConf << endl;
 }
 
+//Uploads a file or a whole directory with one BTCH request
+void batchRequestHandle(SOCKET clientSocket, uint64_t secret) {
+    char path[260];
+
+    cout << "Enter a file or directory path" << endl;
+    cin.getline(path, sizeof(path));
+
+    vector<BatchFileEntry> files = listBatchFiles(path);
+    cout << "Uploading " << files.size() << " files......" << endl;
+
+    SocketTransport transport{ clientSocket };
+    BatchUploader<SocketTransport> uploader(transport, files, secret);
+    BatchResult result = uploader.Run();
+    if (!result.completed) {
+        cout << "Server send error " << WSAGetLastError() << endl;
+        return;
+    }
+    cout << "Server: " << result.filesWritten << " files written, " << result.filesFailed << " failed in "
+        << result.seconds << " s (" << result.filesWritten / result.seconds << " files/s, "
+        << result.bytesWritten / (1024.0 * 1024.0) / result.seconds << " MB/s)" << endl;
+}
+
 void stopRequestHandler(SOCKET clientSocket) {
     cout << "Ending conversation with server." << endl;
     closesocket(clientSocket);
@@ -221,6 +200,9 @@ int main()
     else {
         cout << "socket() is OK !" << endl;
     }
+    //Uploads go out in batches of chunk frames, Nagle would hold the short tail of each batch back
+    BOOL noDelay = TRUE;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
     cout << "----------STEP-3 => CONNECT TO SERVER ------------" << endl;
     //No need to bind here as the OS will automatically do this for us
     sockaddr_in clientService;
@@ -241,34 +223,13 @@ int main()
     //cout << "----------STEP-4 => SENDING AND RECIEVING DATA TO AND FROM SERVER ------------\n\n" << endl;
 
     //Calculate keys
-    srand(10);
-    uint16_t private_key, primitivRoot, prime, pub_key, pub_key_server;
     uint64_t secret;
 
-    primitivRoot =  26363;
-    private_key = rand() % 65536;
-
-    if (recv(clientSocket, (char*)&prime, sizeof(uint16_t), 0) == SOCKET_ERROR) {
-        std::cout << "Error while recieveing prime" << WSAGetLastError() << endl;;
-        return -1;
-    }
-    
-    if (recv(clientSocket, (char*)&pub_key_server, sizeof(uint16_t), 0) == SOCKET_ERROR) {
-        std::cout << "Error while recieveing pub_key_server" << WSAGetLastError() << endl;;
-        return -1;
-    }
- 
-    pub_key = mod_exp(primitivRoot, private_key, prime);
-    
-    cout << "KEYS: " << "PRIVATE: " << private_key << " PRIME: " << prime << " SERVER PUBLIC: " << pub_key_server << endl;
-
-    if (send(clientSocket, (char*)&pub_key, sizeof(uint16_t), 0) == SOCKET_ERROR) {
-        cout << "Error sending keys " << WSAGetLastError() << endl;;
+    if (!clientHandshake(clientSocket, secret)) {
+        cout << "Error during key exchange " << WSAGetLastError() << endl;
         WSACleanup();
         return -1;
     }
-        
-    secret = mod_exp(pub_key_server, private_key, prime);
 
     cout << "SECRET: " << secret << endl;
 
@@ -281,7 +242,8 @@ int main()
     cout << "\t 1) TO SEND MESSAGE TO THE SERVER ENTER 'CHAT'...." << endl;
     cout << "\t 2) FOR SENDING A FILE TO SERVER ENTER 'SEND'...." << endl;
     cout << "\t 3) FOR REQUESTING A FILE FROM SERVER ENTER 'RECV'...." << endl;
-    cout << "\t 4) TO EXIT PLEASE TYPE 'STOP'...." << endl;
+    cout << "\t 4) FOR SENDING MANY FILES OR A DIRECTORY ENTER 'BTCH'...." << endl;
+    cout << "\t 5) TO EXIT PLEASE TYPE 'STOP'...." << endl;
 
     while (true) {
 
@@ -296,6 +258,10 @@ int main()
         else if (strcmp(requestBuffer, "SEND") == 0) {
             fileRequestHandle(clientSocket, recieveConf, secret);
         }
+        //Send many files or a directory to the server
+        else if (strcmp(requestBuffer, "BTCH") == 0) {
+            batchRequestHandle(clientSocket, secret);
+        }
         //Ending the conversation
         else if (strcmp(requestBuffer, "STOP") == 0) {
             stopRequestHandler(clientSocket);
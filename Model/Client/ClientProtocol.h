@@ -0,0 +1,281 @@
+// ClientProtocol.h : Client side of the server's wire protocol, shared by the interactive client, the load
+// generator and the benchmarks.
+#pragma once
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <tchar.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include "../ServerCore/ShmRing.h"
+#include "../ServerCore/DiffieHellman.h"
+#include "../ServerCore/Crc32c.h"
+
+#ifndef MAX_BUFFER
+#define MAX_BUFFER 1024*1024
+#endif
+#ifndef CHUNK_SIZE
+#define CHUNK_SIZE 1024
+#endif
+
+inline void encrypt(char* sendBuffer, int size, uint64_t key) {
+    for (size_t i = 0; i < size; i++) {
+        sendBuffer[i] ^= (key >> (8 * (i % 8))) & 0xFF;
+    }
+}
+
+inline bool recvAll(SOCKET socket, char* buffer, int length) {
+    int received = 0;
+    while (received < length) {
+        int bytes = recv(socket, buffer + received, length - received, 0);
+        if (bytes == SOCKET_ERROR || bytes == 0) {
+            return false;
+        }
+        received += bytes;
+    }
+    return true;
+}
+
+//Opens a TCP connection to the server on 127.0.0.1, INVALID_SOCKET on failure. Every request and frame is
+//handed over in whole sends, so Nagle is switched off: it would hold the tail of one upload batch back until the
+//server's delayed ACK for the previous one.
+inline SOCKET connectToServer(int port) {
+    SOCKET clientSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (clientSocket == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    BOOL noDelay = TRUE;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+    sockaddr_in clientService;
+    clientService.sin_family = AF_INET;
+    InetPton(AF_INET, _T("127.0.0.1"), &clientService.sin_addr.s_addr);
+    clientService.sin_port = htons(port);
+
+    if (connect(clientSocket, (SOCKADDR*)&clientService, sizeof(clientService)) == SOCKET_ERROR) {
+        closesocket(clientSocket);
+        return INVALID_SOCKET;
+    }
+    return clientSocket;
+}
+
+//Diffie-Hellman key exchange (RFC 3526 2048-bit group) run right after connecting: the server sends its public
+//key, the client answers with its own and both sides derive the session secret. The client's key pair is
+//computed while the server works on its own.
+inline bool clientHandshake(SOCKET clientSocket, uint64_t& secret) {
+    unsigned char keyBuffer[DH_BYTES];
+    DhKeyPair keys = dhGenerateKeyPair();
+
+    if (!recvAll(clientSocket, (char*)keyBuffer, DH_BYTES)) {
+        return false;
+    }
+    DhNumber serverKey = dhFromBytes(keyBuffer);
+
+    dhToBytes(keys.publicKey, keyBuffer);
+    if (send(clientSocket, (char*)keyBuffer, DH_BYTES, 0) == SOCKET_ERROR) {
+        return false;
+    }
+
+    DhNumber shared;
+    if (!dhComputeShared(keys.privateKey, serverKey, shared)) {
+        return false;
+    }
+    secret = dhSessionKey(shared);
+    return true;
+}
+
+//Sends a command (CHAT, SEND, STOP) and waits for the server's 32 byte confirmation
+inline bool sendRequest(SOCKET clientSocket, const char* request, char* recieveConf) {
+    if (send(clientSocket, request, strlen(request), 0) == SOCKET_ERROR) {
+        return false;
+    }
+    return recvAll(clientSocket, recieveConf, 32);
+}
+
+//Turns a message stored at frame + sizeof(uint32_t) into a CHAT frame: length prefix followed by the encrypted
+//message. Returns the number of bytes to send, prefix and message go out in a single send so they don't sit in
+//Nagle's algorithm.
+inline int buildChatFrame(char* frame, uint32_t messageLength, uint64_t secret) {
+    memcpy(frame, &messageLength, sizeof(messageLength));
+    encrypt(frame + sizeof(messageLength), messageLength, secret);
+    return sizeof(messageLength) + messageLength;
+}
+
+const int FILE_HEADER_SIZE = sizeof(std::streampos) + 16;
+
+//SEND header: file size followed by the 16 byte extension the server names the file with
+inline void buildFileHeader(char* header, std::streampos fileSize, const char* extension) {
+    memset(header, 0, FILE_HEADER_SIZE);
+    memcpy(header, &fileSize, sizeof(fileSize));
+    memcpy(header + sizeof(fileSize), extension, strnlen(extension, 15));
+}
+
+inline bool sendFileHeader(SOCKET clientSocket, std::streampos fileSize, const char* extension) {
+    char header[FILE_HEADER_SIZE];
+    buildFileHeader(header, fileSize, extension);
+    return send(clientSocket, header, sizeof(header), 0) != SOCKET_ERROR;
+}
+
+//Chunk frames handed to the transport at once by sendFileBody
+const int CHUNK_FRAMES_PER_SEND = 64;
+
+//Blocking transports behind the same two calls, so the upload code below works over TCP and shared memory
+struct SocketTransport {
+    SOCKET socket;
+
+    bool SendAll(const char* buffer, int length) {
+        while (length > 0) {
+            int bytes = send(socket, buffer, length, 0);
+            if (bytes == SOCKET_ERROR) {
+                return false;
+            }
+            buffer += bytes;
+            length -= bytes;
+        }
+        return true;
+    }
+    bool RecvAll(char* buffer, int length) { return recvAll(socket, buffer, length); }
+    //Ends the session, a RecvAll blocked on another thread returns false
+    void Shutdown() { shutdown(socket, SD_BOTH); }
+};
+
+//The TCP connection of a session stays quiet once it moved to shared memory, it only becomes readable when the
+//server closed it or went away
+inline bool controlSocketOpen(SOCKET controlSocket) {
+    WSAPOLLFD socketPoll = { controlSocket, POLLRDNORM, 0 };
+    if (WSAPoll(&socketPoll, 1, 0) == 0) {
+        return true;
+    }
+    char byte;
+    return (socketPoll.revents & (POLLERR | POLLHUP | POLLNVAL)) == 0 && recv(controlSocket, &byte, 1, MSG_PEEK) > 0;
+}
+
+struct ShmTransport {
+    ShmSegment& segment;
+    //Watched while waiting on the rings so a server that died doesn't leave the client blocked forever
+    SOCKET controlSocket;
+
+    bool SendAll(const char* buffer, int length) {
+        return segment.ToServer().WriteAll(buffer, length, [this]() { return controlSocketOpen(controlSocket); });
+    }
+    bool RecvAll(char* buffer, int length) {
+        return segment.ToClient().ReadAll(buffer, length, [this]() { return controlSocketOpen(controlSocket); });
+    }
+    void Shutdown() {
+        segment.ToServer().Close();
+        segment.ToClient().Close();
+    }
+};
+
+//Fault injection for the benchmarks: flips one byte in the middle of every corruptEvery-th send of at least
+//CHUNK_SIZE bytes, so chunk and frame data get damaged but never a header or a bare file digest the server
+//couldn't tell apart from data
+template<typename Transport>
+struct CorruptingTransport {
+    Transport& inner;
+    int corruptEvery;
+    int sends = 0;
+    int corrupted = 0;
+    std::vector<char> scratch;
+
+    bool SendAll(const char* buffer, int length) {
+        if (corruptEvery <= 0 || length < CHUNK_SIZE || ++sends % corruptEvery != 0) {
+            return inner.SendAll(buffer, length);
+        }
+        scratch.assign(buffer, buffer + length);
+        scratch[length / 2] ^= 0x01;
+        corrupted++;
+        return inner.SendAll(scratch.data(), length);
+    }
+    bool RecvAll(char* buffer, int length) { return inner.RecvAll(buffer, length); }
+    void Shutdown() { inner.Shutdown(); }
+};
+
+//Body of a SEND, after the header. readChunk(index, buffer) puts the plain bytes of chunk index (CHUNK_SIZE, the
+//last one shorter) into buffer and returns their number. Each chunk goes out encrypted and followed by the CRC32C
+//of its plain bytes, then comes the CRC32C of the whole file. The server answers with the indices of the chunks
+//that failed their check, these are sent again until it asks for none. The 32 byte confirmation follows right
+//after that last (empty) request.
+template<typename Transport, typename ReadChunk>
+inline bool sendFileBody(Transport& transport, std::streamoff fileSize, ReadChunk readChunk, uint64_t secret) {
+    static const Crc32cCombiner chunkCombiner(CHUNK_SIZE);
+    //Room for the file digest after the last frames, so no small send is left behind for Nagle to hold up
+    std::vector<char> frames(CHUNK_FRAMES_PER_SEND * (CHUNK_SIZE + CHUNK_CRC_SIZE) + sizeof(uint32_t));
+    int framesUsed = 0;
+    int frameBytes = 0;
+
+    auto sendFrames = [&]() {
+        bool sent = frameBytes == 0 || transport.SendAll(frames.data(), frameBytes);
+        framesUsed = 0;
+        frameBytes = 0;
+        return sent;
+    };
+    //Appends the frame of chunk index, the frames go out once there are CHUNK_FRAMES_PER_SEND of them. Returns
+    //the chunk's length or -1 if sending failed.
+    auto addFrame = [&](uint32_t index, uint32_t& chunkCrc) {
+        char* frame = frames.data() + frameBytes;
+        int chunkBytes = readChunk(index, frame);
+        chunkCrc = crc32c(frame, chunkBytes);
+        encrypt(frame, chunkBytes, secret);
+        memcpy(frame + chunkBytes, &chunkCrc, CHUNK_CRC_SIZE);
+        frameBytes += chunkBytes + CHUNK_CRC_SIZE;
+        return ++framesUsed < CHUNK_FRAMES_PER_SEND || sendFrames() ? chunkBytes : -1;
+    };
+
+    uint32_t chunkCount = static_cast<uint32_t>((fileSize + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    uint32_t fileCrc = 0;
+    for (uint32_t index = 0; index < chunkCount; index++) {
+        uint32_t chunkCrc;
+        int chunkBytes = addFrame(index, chunkCrc);
+        if (chunkBytes < 0) {
+            return false;
+        }
+        fileCrc = chunkBytes == CHUNK_SIZE ? chunkCombiner.Combine(fileCrc, chunkCrc)
+            : Crc32cCombiner(chunkBytes).Combine(fileCrc, chunkCrc);
+    }
+    memcpy(frames.data() + frameBytes, &fileCrc, sizeof(fileCrc));
+    frameBytes += sizeof(fileCrc);
+    if (!sendFrames()) {
+        return false;
+    }
+
+    uint32_t requested;
+    while (transport.RecvAll((char*)&requested, sizeof(requested))) {
+        if (requested == 0) {
+            return true;
+        }
+        std::vector<uint32_t> indices(requested);
+        if (!transport.RecvAll((char*)indices.data(), static_cast<int>(requested * sizeof(uint32_t)))) {
+            return false;
+        }
+        for (uint32_t index : indices) {
+            uint32_t chunkCrc;
+            if (index >= chunkCount || addFrame(index, chunkCrc) < 0) {
+                return false;
+            }
+        }
+        if (!sendFrames()) {
+            return false;
+        }
+    }
+    return false;
+}
+
+//Moves an established session to shared memory. Afterwards every request and its data go through the rings of
+//segment (ToServer().WriteAll / ToClient().ReadAll) instead of clientSocket, which has to stay open until the
+//session ends. False if the server couldn't set up the segment, the session then carries on over TCP.
+inline bool openSharedMemory(SOCKET clientSocket, ShmSegment& segment) {
+    char recieveConf[32];
+    uint32_t processId = GetCurrentProcessId();
+    char segmentName[SHM_NAME_SIZE];
+
+    if (!sendRequest(clientSocket, "SHMO", recieveConf) ||
+        send(clientSocket, (char*)&processId, sizeof(processId), 0) == SOCKET_ERROR ||
+        !recvAll(clientSocket, segmentName, SHM_NAME_SIZE) || segmentName[0] == '\0') {
+        return false;
+    }
+    segmentName[SHM_NAME_SIZE - 1] = '\0';
+    return segment.Open(segmentName);
+}
@@ -0,0 +1,92 @@
+// LatencyHistogram.h : HDR style latency histogram used by the load generator.
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//Log-linear buckets as in HdrHistogram: every power of two range is split into 1024 linear sub-buckets, which
+//keeps three significant digits for any 64 bit value. The counts are a fixed size array, so recording is a
+//single increment and histograms of different threads merge by adding them up.
+class LatencyHistogram {
+private:
+    static const int SUB_BUCKET_HALF_COUNT_MAGNITUDE = 10;
+    static const int SUB_BUCKET_HALF_COUNT = 1 << SUB_BUCKET_HALF_COUNT_MAGNITUDE;
+    static const uint64_t SUB_BUCKET_MASK = (2 * SUB_BUCKET_HALF_COUNT) - 1;
+    //Buckets needed to cover the whole uint64_t range with 2048 sub-buckets in the first one
+    static const int BUCKET_COUNT = 64 - (SUB_BUCKET_HALF_COUNT_MAGNITUDE + 1) + 1;
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t maxValue = 0;
+    double sum = 0;
+
+    static size_t CountsIndex(uint64_t value) {
+        int pow2Ceiling = 64 - std::countl_zero(value | SUB_BUCKET_MASK);
+        int bucketIndex = pow2Ceiling - (SUB_BUCKET_HALF_COUNT_MAGNITUDE + 1);
+        int subBucketIndex = static_cast<int>(value >> bucketIndex);
+        return (static_cast<size_t>(bucketIndex + 1) << SUB_BUCKET_HALF_COUNT_MAGNITUDE) + (subBucketIndex - SUB_BUCKET_HALF_COUNT);
+    }
+
+    //Largest value that lands in the same slot as the values recorded at this index
+    static uint64_t HighestEquivalentValue(size_t index) {
+        int bucketIndex = static_cast<int>(index >> SUB_BUCKET_HALF_COUNT_MAGNITUDE) - 1;
+        uint64_t subBucketIndex = (index & (SUB_BUCKET_HALF_COUNT - 1)) + SUB_BUCKET_HALF_COUNT;
+        if (bucketIndex < 0) {
+            subBucketIndex -= SUB_BUCKET_HALF_COUNT;
+            bucketIndex = 0;
+        }
+        return (subBucketIndex << bucketIndex) + ((uint64_t(1) << bucketIndex) - 1);
+    }
+
+public:
+    LatencyHistogram() : counts(static_cast<size_t>(BUCKET_COUNT + 1) * SUB_BUCKET_HALF_COUNT, 0) {}
+
+    void Record(uint64_t value) {
+        counts[CountsIndex(value)]++;
+        total++;
+        sum += static_cast<double>(value);
+        maxValue = std::max(maxValue, value);
+    }
+
+    void Merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    uint64_t Count() const { return total; }
+    uint64_t Max() const { return maxValue; }
+    double Mean() const { return total == 0 ? 0 : sum / total; }
+
+    uint64_t ValueAtPercentile(double percentile) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percentile / 100.0 * total)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= target) {
+                return std::min(HighestEquivalentValue(i), maxValue);
+            }
+        }
+        return maxValue;
+    }
+
+    std::string ToJson() const {
+        std::ostringstream json;
+        json << "{ \"count\": " << Count() << ", \"mean\": " << Mean()
+            << ", \"p50\": " << ValueAtPercentile(50) << ", \"p90\": " << ValueAtPercentile(90)
+            << ", \"p99\": " << ValueAtPercentile(99) << ", \"p99_9\": " << ValueAtPercentile(99.9)
+            << ", \"p99_99\": " << ValueAtPercentile(99.99) << ", \"max\": " << Max() << " }";
+        return json.str();
+    }
+};
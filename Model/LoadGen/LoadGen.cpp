@@ -0,0 +1,364 @@
+// LoadGen.cpp : Open-loop load generator for the server. Opens many sessions, drives a CHAT/SEND mix at a target
+// request rate and prints handshake rate, request rate, throughput and latency percentiles as JSON.
+// Every worker thread sends the requests of its sessions one at a time, so a slow server can make it fall behind
+// its schedule. The achieved rate and the schedule lag are reported and the run fails when the generator couldn't
+// keep up, add --threads then.
+// Start the server first, then run e.g. LoadGen --connections 2000 --rate 5000 --chat-ratio 0.9 --output run.json
+#define WIN32_LEAN_AND_MEAN
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <string>
+#include "../Client/ClientProtocol.h"
+#include "LatencyHistogram.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct LoadConfig {
+    int port = 55555;
+    int connections = 1000;
+    int threads = 4;
+    //Requests per second over all sessions together
+    double rate = 1000;
+    //Share of CHAT requests, the rest are SEND
+    double chatRatio = 0.9;
+    int chatBytes = 64;
+    int sendBytes = 64 * 1024;
+    int warmupSeconds = 2;
+    int durationSeconds = 10;
+    //The run fails if the p99 of the schedule lag is above this
+    double maxLagMs = 10;
+    //or if fewer requests than this share of the scheduled ones completed per second
+    double rateTolerance = 0.05;
+    //JSON goes to this file, or to stdout when empty
+    string output;
+};
+
+struct Session {
+    SOCKET socket = INVALID_SOCKET;
+    uint64_t secret = 0;
+};
+
+//Each worker fills its own stats, main merges them once the run is over
+struct WorkerStats {
+    LatencyHistogram handshakeLatency;
+    LatencyHistogram chatLatency;
+    LatencyHistogram sendLatency;
+    uint64_t handshakes = 0;
+    uint64_t failedHandshakes = 0;
+    //Only requests that were due inside the measurement window are counted below
+    uint64_t chatCompleted = 0;
+    uint64_t sendCompleted = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    //Requests due inside the measurement window, completed or not
+    uint64_t scheduled = 0;
+    //Time from a measured request being due to the worker starting it
+    LatencyHistogram scheduleLag;
+    //End of the last measured request, after the window when the worker fell behind
+    Clock::time_point lastCompletion;
+};
+
+//Shared timeline of the run. Workers connect their sessions, then wait for main to publish the start time.
+struct RunClock {
+    atomic<int> connectedWorkers{ 0 };
+    atomic<bool> started{ false };
+    Clock::time_point loadStart;
+    Clock::time_point measureStart;
+    Clock::time_point loadEnd;
+};
+
+static uint64_t microsecondsBetween(Clock::time_point from, Clock::time_point to) {
+    return static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(to - from).count());
+}
+
+//sleep_until alone overshoots by up to a scheduler tick on Windows, which would show up as latency. Sleep most
+//of the way and yield for the last millisecond.
+static void waitUntil(Clock::time_point due) {
+    auto spinWindow = chrono::milliseconds(1);
+    auto now = Clock::now();
+    if (due - now > spinWindow) {
+        this_thread::sleep_for(due - now - spinWindow);
+    }
+    while (Clock::now() < due) {
+        this_thread::yield();
+    }
+}
+
+static bool runChat(Session& session, const LoadConfig& config, vector<char>& frame) {
+    char recieveConf[32];
+    memset(frame.data() + sizeof(uint32_t), 'c', config.chatBytes - 1);
+    frame[sizeof(uint32_t) + config.chatBytes - 1] = '\0';
+    int frameBytes = buildChatFrame(frame.data(), config.chatBytes, session.secret);
+
+    return sendRequest(session.socket, "CHAT", recieveConf) &&
+        send(session.socket, frame.data(), frameBytes, 0) != SOCKET_ERROR &&
+        recvAll(session.socket, recieveConf, sizeof(recieveConf));
+}
+
+//Uploads sendBytes made of plainChunk repeated, each chunk checksummed and encrypted like Client.cpp does
+static bool runSend(Session& session, const LoadConfig& config, const vector<char>& plainChunk) {
+    char recieveConf[32];
+    if (!sendRequest(session.socket, "SEND", recieveConf) ||
+        !sendFileHeader(session.socket, static_cast<streamoff>(config.sendBytes), "bin")) {
+        return false;
+    }
+    SocketTransport transport{ session.socket };
+    auto readChunk = [&](uint32_t index, char* chunkBuffer) {
+        int chunkBytes = min(CHUNK_SIZE, config.sendBytes - static_cast<int>(index) * CHUNK_SIZE);
+        memcpy(chunkBuffer, plainChunk.data(), chunkBytes);
+        return chunkBytes;
+    };
+    return sendFileBody(transport, config.sendBytes, readChunk, session.secret) &&
+        recvAll(session.socket, recieveConf, sizeof(recieveConf));
+}
+
+/*Drives sessionCount sessions. Every session gets its own Poisson arrival process with rate / connections, and
+the latency of a request is measured from the time it was due, not from when the worker got to it. If the server
+stalls, the requests that should have been sent meanwhile are still charged the full wait (no coordinated
+omission), even though this worker sends them one after the other.*/
+static void worker(const LoadConfig& config, int sessionCount, unsigned seed, RunClock& runClock, WorkerStats& stats) {
+    mt19937_64 random(seed);
+    vector<Session> sessions;
+    sessions.reserve(sessionCount);
+
+    for (int i = 0; i < sessionCount; i++) {
+        auto handshakeStart = Clock::now();
+        Session session;
+        session.socket = connectToServer(config.port);
+        if (session.socket == INVALID_SOCKET || !clientHandshake(session.socket, session.secret)) {
+            if (session.socket != INVALID_SOCKET) {
+                closesocket(session.socket);
+            }
+            stats.failedHandshakes++;
+            continue;
+        }
+        stats.handshakeLatency.Record(microsecondsBetween(handshakeStart, Clock::now()));
+        stats.handshakes++;
+        sessions.push_back(move(session));
+    }
+
+    runClock.connectedWorkers++;
+    while (!runClock.started) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+
+    double sessionRate = config.rate / config.connections;
+    exponential_distribution<double> interArrival(sessionRate);
+    bernoulli_distribution isChat(config.chatRatio);
+    auto nextArrival = [&](Clock::time_point from) {
+        return from + chrono::duration_cast<Clock::duration>(chrono::duration<double>(interArrival(random)));
+    };
+
+    //Min-heap of (due time, session index)
+    using Arrival = pair<Clock::time_point, size_t>;
+    priority_queue<Arrival, vector<Arrival>, greater<Arrival>> arrivals;
+    for (size_t i = 0; i < sessions.size(); i++) {
+        arrivals.push({ nextArrival(runClock.loadStart), i });
+    }
+
+    vector<char> frame(sizeof(uint32_t) + config.chatBytes);
+    vector<char> plainChunk(CHUNK_SIZE);
+    for (int j = 0; j < CHUNK_SIZE; j++) {
+        plainChunk[j] = static_cast<char>(j);
+    }
+
+    while (!arrivals.empty()) {
+        auto [due, index] = arrivals.top();
+        arrivals.pop();
+        if (due >= runClock.loadEnd) {
+            break;
+        }
+        waitUntil(due);
+        auto started = Clock::now();
+
+        Session& session = sessions[index];
+        bool chat = isChat(random);
+        bool ok = chat ? runChat(session, config, frame) : runSend(session, config, plainChunk);
+        auto finished = Clock::now();
+        uint64_t latency = microsecondsBetween(due, finished);
+
+        bool measured = due >= runClock.measureStart;
+        if (measured) {
+            stats.scheduled++;
+            stats.scheduleLag.Record(microsecondsBetween(due, started));
+            stats.lastCompletion = max(stats.lastCompletion, finished);
+        }
+        if (!ok) {
+            //A broken session stays out of the schedule for the rest of the run
+            stats.errors += measured ? 1 : 0;
+            closesocket(session.socket);
+            session.socket = INVALID_SOCKET;
+            continue;
+        }
+        if (measured) {
+            if (chat) {
+                stats.chatLatency.Record(latency);
+                stats.chatCompleted++;
+                stats.bytes += config.chatBytes;
+            }
+            else {
+                stats.sendLatency.Record(latency);
+                stats.sendCompleted++;
+                stats.bytes += config.sendBytes;
+            }
+        }
+        arrivals.push({ nextArrival(due), index });
+    }
+
+    for (Session& session : sessions) {
+        if (session.socket != INVALID_SOCKET) {
+            send(session.socket, "STOP", 4, 0);
+            closesocket(session.socket);
+        }
+    }
+}
+
+static bool parseArguments(int argc, char* argv[], LoadConfig& config) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string option = argv[i];
+        const char* value = argv[i + 1];
+        if (option == "--port") config.port = atoi(value);
+        else if (option == "--connections") config.connections = atoi(value);
+        else if (option == "--threads") config.threads = atoi(value);
+        else if (option == "--rate") config.rate = atof(value);
+        else if (option == "--chat-ratio") config.chatRatio = atof(value);
+        else if (option == "--chat-bytes") config.chatBytes = atoi(value);
+        else if (option == "--send-bytes") config.sendBytes = atoi(value);
+        else if (option == "--warmup-s") config.warmupSeconds = atoi(value);
+        else if (option == "--duration-s") config.durationSeconds = atoi(value);
+        else if (option == "--max-lag-ms") config.maxLagMs = atof(value);
+        else if (option == "--rate-tolerance") config.rateTolerance = atof(value);
+        else if (option == "--output") config.output = value;
+        else {
+            cerr << "Unknown option " << option << endl;
+            return false;
+        }
+    }
+    if (config.connections <= 0 || config.threads <= 0 || config.rate <= 0 || config.chatBytes <= 0 ||
+        config.chatBytes >= MAX_BUFFER || config.sendBytes <= 0 || config.durationSeconds <= 0 ||
+        config.maxLagMs < 0 || config.rateTolerance < 0 || config.rateTolerance >= 1) {
+        cerr << "Invalid configuration" << endl;
+        return false;
+    }
+    config.threads = min(config.threads, config.connections);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    LoadConfig config;
+    if (!parseArguments(argc, argv, config)) {
+        return 1;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cerr << "Winsock dll not found" << endl;
+        return 1;
+    }
+
+    RunClock runClock;
+    vector<WorkerStats> stats(config.threads);
+    vector<thread> workers;
+    random_device seedSource;
+
+    auto connectStart = Clock::now();
+    for (int i = 0; i < config.threads; i++) {
+        int sessionCount = config.connections / config.threads + (i < config.connections % config.threads ? 1 : 0);
+        workers.emplace_back(worker, cref(config), sessionCount, seedSource(), ref(runClock), ref(stats[i]));
+    }
+    while (runClock.connectedWorkers < config.threads) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    chrono::duration<double> connectElapsed = Clock::now() - connectStart;
+    cerr << "Connected in " << connectElapsed.count() << " s, running load..." << endl;
+
+    runClock.loadStart = Clock::now();
+    runClock.measureStart = runClock.loadStart + chrono::seconds(config.warmupSeconds);
+    runClock.loadEnd = runClock.measureStart + chrono::seconds(config.durationSeconds);
+    runClock.started = true;
+
+    for (thread& workerThread : workers) {
+        workerThread.join();
+    }
+    WSACleanup();
+
+    WorkerStats total;
+    for (WorkerStats& workerStats : stats) {
+        total.handshakeLatency.Merge(workerStats.handshakeLatency);
+        total.chatLatency.Merge(workerStats.chatLatency);
+        total.sendLatency.Merge(workerStats.sendLatency);
+        total.handshakes += workerStats.handshakes;
+        total.failedHandshakes += workerStats.failedHandshakes;
+        total.chatCompleted += workerStats.chatCompleted;
+        total.sendCompleted += workerStats.sendCompleted;
+        total.errors += workerStats.errors;
+        total.bytes += workerStats.bytes;
+        total.scheduled += workerStats.scheduled;
+        total.scheduleLag.Merge(workerStats.scheduleLag);
+        total.lastCompletion = max(total.lastCompletion, workerStats.lastCompletion);
+    }
+    LatencyHistogram allLatency;
+    allLatency.Merge(total.chatLatency);
+    allLatency.Merge(total.sendLatency);
+
+    //Rates are taken over the time the measured requests really took, which is longer than the window when the
+    //workers fell behind
+    chrono::duration<double> measuredElapsed = max(runClock.loadEnd, total.lastCompletion) - runClock.measureStart;
+    double seconds = measuredElapsed.count();
+    double scheduledRate = total.scheduled / static_cast<double>(config.durationSeconds);
+    double achievedRate = (total.chatCompleted + total.sendCompleted) / seconds;
+    double lagP99Ms = total.scheduleLag.ValueAtPercentile(99) / 1000.0;
+    bool fellBehind = achievedRate < scheduledRate * (1 - config.rateTolerance) || lagP99Ms > config.maxLagMs;
+
+    ostringstream json;
+    json << "{\n"
+        << "  \"config\": { \"connections\": " << config.connections << ", \"threads\": " << config.threads
+        << ", \"target_rate\": " << config.rate << ", \"chat_ratio\": " << config.chatRatio
+        << ", \"chat_bytes\": " << config.chatBytes << ", \"send_bytes\": " << config.sendBytes
+        << ", \"warmup_s\": " << config.warmupSeconds << ", \"duration_s\": " << config.durationSeconds
+        << ", \"max_lag_ms\": " << config.maxLagMs << ", \"rate_tolerance\": " << config.rateTolerance << " },\n"
+        << "  \"schedule\": { \"target_rate\": " << config.rate << ", \"scheduled_rate\": " << scheduledRate
+        << ", \"achieved_rate\": " << achievedRate << ", \"measured_s\": " << seconds
+        << ", \"fell_behind\": " << (fellBehind ? "true" : "false")
+        << ", \"lag_us\": " << total.scheduleLag.ToJson() << " },\n"
+        << "  \"handshakes\": { \"completed\": " << total.handshakes << ", \"failed\": " << total.failedHandshakes
+        << ", \"per_sec\": " << total.handshakes / connectElapsed.count()
+        << ", \"latency_us\": " << total.handshakeLatency.ToJson() << " },\n"
+        << "  \"requests\": { \"chat\": " << total.chatCompleted << ", \"send\": " << total.sendCompleted
+        << ", \"errors\": " << total.errors << ", \"messages_per_sec\": " << (total.chatCompleted + total.sendCompleted) / seconds
+        << ", \"mb_per_sec\": " << total.bytes / (1024.0 * 1024.0) / seconds << " },\n"
+        << "  \"latency_us\": {\n"
+        << "    \"chat\": " << total.chatLatency.ToJson() << ",\n"
+        << "    \"send\": " << total.sendLatency.ToJson() << ",\n"
+        << "    \"all\": " << allLatency.ToJson() << "\n"
+        << "  }\n"
+        << "}\n";
+
+    if (config.output.empty()) {
+        cout << json.str();
+    }
+    else {
+        ofstream outputFile(config.output);
+        outputFile << json.str();
+        cerr << "Results written to " << config.output << endl;
+    }
+
+    cerr << "Target " << config.rate << " req/s, scheduled " << scheduledRate << " req/s, achieved " << achievedRate
+        << " req/s, schedule lag p50 " << total.scheduleLag.ValueAtPercentile(50) / 1000.0 << " ms p99 " << lagP99Ms
+        << " ms max " << total.scheduleLag.Max() / 1000.0 << " ms" << endl;
+    if (fellBehind) {
+        cerr << "FAILED: the generator fell behind its schedule, the server got less load than asked for. "
+            << "Use more --threads or a lower --rate." << endl;
+        return 1;
+    }
+    return 0;
+}
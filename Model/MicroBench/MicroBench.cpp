@@ -0,0 +1,425 @@
+// MicroBench.cpp : Microbenchmarks for the primitives in ServerCore (cipher, Diffie-Hellman, chunk checksums, file
+// naming and the thread pool). Prints a table, writes the results as JSON with --json and compares them against a saved run
+// with --baseline, e.g.
+//   MicroBench --json baselines\my-machine.json
+//   MicroBench --baseline baselines\my-machine.json --threshold 10
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <functional>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <filesystem>
+#include "ServerCore.h"
+#include "ThreadPool.h"
+#include "DiffieHellman.h"
+#include "Crc32c.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct BenchOptions {
+    int samples = 20;
+    int warmupMs = 200;
+    //Iterations per sample are doubled until one sample takes at least this long
+    int minSampleMs = 10;
+    //Only cases whose name contains this string are run
+    string filter;
+    string jsonPath;
+    string baselinePath;
+    //Percent the median may grow over the baseline before it counts as a regression
+    double threshold = 10;
+};
+
+struct BenchCase {
+    string name;
+    //Bytes processed per operation, 0 when throughput makes no sense for the case
+    size_t bytesPerOp;
+    //Runs the operation `iterations` times
+    function<void(uint64_t iterations)> run;
+};
+
+struct BenchResult {
+    string name;
+    size_t bytesPerOp = 0;
+    uint64_t iterations = 0;
+    int samples = 0;
+    double minNs = 0;
+    double medianNs = 0;
+    double meanNs = 0;
+    double stddevNs = 0;
+};
+
+//Results and buffers are handed to these volatiles so the optimizer can't drop the work being measured
+static volatile uint64_t resultSink;
+static void* volatile bufferSink;
+
+static void keepResult(uint64_t value) {
+    resultSink = resultSink + value;
+}
+
+static void keepBuffer(void* buffer) {
+    bufferSink = buffer;
+}
+
+static double elapsedNs(Clock::time_point start) {
+    return static_cast<double>(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+}
+
+static BenchResult runCase(const BenchCase& benchCase, const BenchOptions& options) {
+    //Warmup: get caches, branch predictors and the pool threads going before anything is measured
+    auto warmupStart = Clock::now();
+    for (uint64_t iterations = 1; elapsedNs(warmupStart) < options.warmupMs * 1e6; iterations *= 2) {
+        benchCase.run(iterations);
+    }
+
+    uint64_t iterations = 1;
+    while (true) {
+        auto start = Clock::now();
+        benchCase.run(iterations);
+        if (elapsedNs(start) >= options.minSampleMs * 1e6 || iterations >= (uint64_t(1) << 40)) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    vector<double> nsPerOp;
+    for (int i = 0; i < options.samples; i++) {
+        auto start = Clock::now();
+        benchCase.run(iterations);
+        nsPerOp.push_back(elapsedNs(start) / iterations);
+    }
+    sort(nsPerOp.begin(), nsPerOp.end());
+
+    BenchResult result;
+    result.name = benchCase.name;
+    result.bytesPerOp = benchCase.bytesPerOp;
+    result.iterations = iterations;
+    result.samples = options.samples;
+    result.minNs = nsPerOp.front();
+    size_t middle = nsPerOp.size() / 2;
+    result.medianNs = nsPerOp.size() % 2 ? nsPerOp[middle] : (nsPerOp[middle - 1] + nsPerOp[middle]) / 2;
+    result.meanNs = accumulate(nsPerOp.begin(), nsPerOp.end(), 0.0) / nsPerOp.size();
+    double variance = 0;
+    for (double sample : nsPerOp) {
+        variance += (sample - result.meanNs) * (sample - result.meanNs);
+    }
+    result.stddevNs = nsPerOp.size() > 1 ? sqrt(variance / (nsPerOp.size() - 1)) : 0;
+    return result;
+}
+
+static double opsPerSecond(const BenchResult& result) {
+    return 1e9 / result.medianNs;
+}
+
+static double gigabytesPerSecond(const BenchResult& result) {
+    return result.bytesPerOp == 0 ? 0 : result.bytesPerOp / result.medianNs;
+}
+
+static vector<BenchCase> buildCases() {
+    vector<BenchCase> cases;
+    mt19937 random(12345);
+
+    //The cipher runs over chat messages, CHUNK_SIZE file chunks, 64 KiB bulk quanta and MAX_BUFFER messages
+    for (size_t size : { 64, 1024, 64 * 1024, 1024 * 1024 }) {
+        auto buffer = make_shared<vector<char>>(size, 'x');
+        uint64_t key = 0x0123456789ABCDEFull;
+        cases.push_back({ "encrypt/" + to_string(size), size, [buffer, key](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++) {
+                encrypt(buffer->data(), static_cast<int>(buffer->size()), key);
+            }
+            keepBuffer(buffer->data());
+        } });
+        cases.push_back({ "decrypt/" + to_string(size), size, [buffer, key](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++) {
+                decrypt(buffer->data(), static_cast<int>(buffer->size()), key);
+            }
+            keepBuffer(buffer->data());
+        } });
+    }
+
+    //Chunk checksums on the path this CPU takes and on the table fallback, plus folding one chunk CRC into a file
+    //digest. Both ends of an upload pay the CRC once per chunk on top of the cipher.
+    for (size_t size : { 1024, 64 * 1024, 1024 * 1024 }) {
+        auto buffer = make_shared<vector<char>>(size);
+        for (char& byte : *buffer) {
+            byte = static_cast<char>(random());
+        }
+        cases.push_back({ "crc32c/" + to_string(size), size, [buffer](uint64_t iterations) {
+            uint64_t total = 0;
+            for (uint64_t i = 0; i < iterations; i++) {
+                total += crc32c(buffer->data(), buffer->size());
+            }
+            keepResult(total);
+        } });
+        cases.push_back({ "crc32c/table/" + to_string(size), size, [buffer](uint64_t iterations) {
+            uint64_t total = 0;
+            for (uint64_t i = 0; i < iterations; i++) {
+                total += crc32cUpdateTable(~0u, buffer->data(), buffer->size());
+            }
+            keepResult(total);
+        } });
+    }
+    auto chunkCombiner = make_shared<Crc32cCombiner>(1024);
+    cases.push_back({ "crc32c/combine", 0, [chunkCombiner](uint64_t iterations) {
+        uint32_t digest = 0;
+        for (uint64_t i = 0; i < iterations; i++) {
+            digest = chunkCombiner->Combine(digest, static_cast<uint32_t>(i));
+        }
+        keepResult(digest);
+    } });
+
+    //Key exchange: the Montgomery product everything is built from, exponentiations with exponents of all zero and
+    //all one bits (their times should match, the exponentiation is constant time) and the server's share of a
+    //handshake, whose ops/s is the handshake rate of one core
+    auto randomNumber = [&random]() {
+        DhNumber number;
+        for (uint64_t& limb : number.limb) {
+            limb = (static_cast<uint64_t>(random()) << 32) | random();
+        }
+        //Below p, whose top limb is all ones
+        number.limb[DH_LIMBS - 1] >>= 1;
+        return number;
+    };
+    auto dhInputs = make_shared<vector<DhNumber>>();
+    for (int i = 0; i < 2; i++) {
+        dhInputs->push_back(randomNumber());
+    }
+    cases.push_back({ "dh/montgomeryMultiply", 0, [dhInputs](uint64_t iterations) {
+        DhNumber product = (*dhInputs)[0];
+        for (uint64_t i = 0; i < iterations; i++) {
+            dhMontgomeryMultiply(product, product, (*dhInputs)[1], dhGroup());
+        }
+        keepResult(product.limb[0]);
+    } });
+    for (uint64_t exponentLimb : { uint64_t(0), ~uint64_t(0) }) {
+        DhNumber exponent = {};
+        for (int i = 0; i < DH_PRIVATE_BITS / 64; i++) {
+            exponent.limb[i] = exponentLimb;
+        }
+        string name = exponentLimb == 0 ? "dh/modExp/zero-exponent" : "dh/modExp/ones-exponent";
+        cases.push_back({ name, 0, [dhInputs, exponent](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++) {
+                keepResult(dhModExp((*dhInputs)[0], exponent, DH_PRIVATE_BITS).limb[0]);
+            }
+        } });
+    }
+    auto peerKey = make_shared<DhNumber>(dhGenerateKeyPair().publicKey);
+    auto serverHandshake = [peerKey](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++) {
+            DhKeyPair keys = dhGenerateKeyPair();
+            DhNumber shared;
+            dhComputeShared(keys.privateKey, *peerKey, shared);
+            keepResult(dhSessionKey(shared));
+        }
+    };
+    cases.push_back({ "dh/handshake", 0, serverHandshake });
+    //Every thread runs the full iteration count, so the time per op stays a per core figure and shows how well
+    //handshakes scale across cores
+    if (thread::hardware_concurrency() > 1) {
+        int threads = thread::hardware_concurrency();
+        cases.push_back({ "dh/handshake/" + to_string(threads) + "-threads", 0, [serverHandshake, threads](uint64_t iterations) {
+            vector<thread> workers;
+            for (int i = 0; i < threads; i++) {
+                workers.emplace_back(serverHandshake, iterations);
+            }
+            for (thread& worker : workers) {
+                worker.join();
+            }
+        } });
+    }
+
+    cases.push_back({ "getCurrentTimeFilename", 0, [](uint64_t iterations) {
+        uint64_t total = 0;
+        for (uint64_t i = 0; i < iterations; i++) {
+            total += getCurrentTimeFilename("txt").size();
+        }
+        keepResult(total);
+    } });
+
+    //QueueTask until the future is ready: one task at a time (latency) and a burst of tasks (throughput per task)
+    vector<int> threadCounts = { 1 };
+    if (thread::hardware_concurrency() > 1) {
+        threadCounts.push_back(thread::hardware_concurrency());
+    }
+    for (int threads : threadCounts) {
+        auto pool = make_shared<ThreadPool>();
+        pool->SetTaskTracing(false);
+        //Pools are only started once a case using them runs, so filtered out cases don't leave threads around
+        auto started = make_shared<once_flag>();
+        auto startPool = [pool, threads, started]() {
+            call_once(*started, [&]() { pool->Start(threads); });
+        };
+        cases.push_back({ "ThreadPool/QueueTask-get/" + to_string(threads) + "-threads", 0,
+            [pool, startPool](uint64_t iterations) {
+            startPool();
+            uint64_t total = 0;
+            for (uint64_t i = 0; i < iterations; i++) {
+                total += pool->QueueTask([](uint64_t value) { return value; }, i).get();
+            }
+            keepResult(total);
+        } });
+        cases.push_back({ "ThreadPool/QueueTask-burst/" + to_string(threads) + "-threads", 0,
+            [pool, startPool](uint64_t iterations) {
+            startPool();
+            vector<future<uint64_t>> results;
+            results.reserve(iterations);
+            for (uint64_t i = 0; i < iterations; i++) {
+                results.push_back(pool->QueueTask([](uint64_t value) { return value; }, i));
+            }
+            uint64_t total = 0;
+            for (auto& result : results) {
+                total += result.get();
+            }
+            keepResult(total);
+        } });
+    }
+    return cases;
+}
+
+static string resultsToJson(const vector<BenchResult>& results, const BenchOptions& options) {
+    ostringstream json;
+#ifdef _DEBUG
+    const char* build = "debug";
+#else
+    const char* build = "release";
+#endif
+    json << "{\n"
+        << "  \"build\": \"" << build << "\",\n"
+        << "  \"hardware_threads\": " << thread::hardware_concurrency() << ",\n"
+        << "  \"samples\": " << options.samples << ",\n"
+        << "  \"results\": [\n";
+    //One result per line, --baseline reads them back line by line
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& result = results[i];
+        json << "    { \"name\": \"" << result.name << "\", \"bytes_per_op\": " << result.bytesPerOp
+            << ", \"iterations\": " << result.iterations << ", \"min_ns\": " << result.minNs
+            << ", \"median_ns\": " << result.medianNs << ", \"mean_ns\": " << result.meanNs
+            << ", \"stddev_ns\": " << result.stddevNs << ", \"ops_per_s\": " << opsPerSecond(result) << ", \"gb_per_s\": " << gigabytesPerSecond(result) << " }"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+    return json.str();
+}
+
+//Reads name -> median_ns back from a file written by --json
+static bool loadBaseline(const string& path, map<string, double>& medians) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+    string line;
+    const string nameKey = "\"name\": \"";
+    const string medianKey = "\"median_ns\": ";
+    while (getline(file, line)) {
+        size_t namePos = line.find(nameKey);
+        size_t medianPos = line.find(medianKey);
+        if (namePos == string::npos || medianPos == string::npos) {
+            continue;
+        }
+        namePos += nameKey.size();
+        string name = line.substr(namePos, line.find('"', namePos) - namePos);
+        medians[name] = atof(line.c_str() + medianPos + medianKey.size());
+    }
+    return true;
+}
+
+static bool parseArguments(int argc, char* argv[], BenchOptions& options) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string option = argv[i];
+        const char* value = argv[i + 1];
+        if (option == "--samples") options.samples = max(1, atoi(value));
+        else if (option == "--warmup-ms") options.warmupMs = atoi(value);
+        else if (option == "--min-sample-ms") options.minSampleMs = atoi(value);
+        else if (option == "--filter") options.filter = value;
+        else if (option == "--json") options.jsonPath = value;
+        else if (option == "--baseline") options.baselinePath = value;
+        else if (option == "--threshold") options.threshold = atof(value);
+        else {
+            cerr << "Unknown option " << option << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    BenchOptions options;
+    if (!parseArguments(argc, argv, options)) {
+        return 1;
+    }
+
+    map<string, double> baseline;
+    if (!options.baselinePath.empty() && !loadBaseline(options.baselinePath, baseline)) {
+        cerr << "Can't read baseline " << options.baselinePath << ", record one first with --json "
+            << options.baselinePath << endl;
+        return 1;
+    }
+
+    vector<BenchResult> results;
+    int regressions = 0;
+
+    cout << left << setw(44) << "benchmark" << right << setw(14) << "median ns" << setw(12) << "stddev"
+        << setw(14) << "ops/s" << setw(10) << "GB/s";
+    if (!baseline.empty()) {
+        cout << setw(14) << "baseline ns" << setw(10) << "change";
+    }
+    cout << endl;
+
+    for (const BenchCase& benchCase : buildCases()) {
+        if (!options.filter.empty() && benchCase.name.find(options.filter) == string::npos) {
+            continue;
+        }
+        BenchResult result = runCase(benchCase, options);
+        results.push_back(result);
+
+        cout << left << setw(44) << result.name << right << fixed << setprecision(1) << setw(14) << result.medianNs
+            << setw(12) << result.stddevNs << setw(14) << opsPerSecond(result) << setprecision(2) << setw(10)
+            << gigabytesPerSecond(result);
+        auto base = baseline.find(result.name);
+        if (base != baseline.end() && base->second > 0) {
+            double change = (result.medianNs / base->second - 1) * 100;
+            cout << setprecision(1) << setw(14) << base->second << setw(9) << showpos << change << "%" << noshowpos;
+            if (change > options.threshold) {
+                cout << "  REGRESSION";
+                regressions++;
+            }
+            else if (change < -options.threshold) {
+                cout << "  improved";
+            }
+        }
+        cout << endl;
+    }
+
+    if (!options.jsonPath.empty()) {
+        //The first baseline of a checkout also creates the baselines directory
+        error_code error;
+        filesystem::path parent = filesystem::path(options.jsonPath).parent_path();
+        if (!parent.empty()) {
+            filesystem::create_directories(parent, error);
+        }
+        ofstream jsonFile(options.jsonPath);
+        jsonFile << resultsToJson(results, options);
+        if (!jsonFile) {
+            cerr << "Can't write " << options.jsonPath << endl;
+            return 1;
+        }
+        cout << "Results written to " << options.jsonPath << endl;
+    }
+    if (!baseline.empty()) {
+        cout << regressions << " regression(s) over " << options.threshold << "% against " << options.baselinePath << endl;
+    }
+    //Non-zero exit code lets scripts fail on regressions
+    return regressions > 0 ? 2 : 0;
+}
@@ -0,0 +1,173 @@
+// MixedWorkloadBench.cpp : Measures CHAT latency on the server while other clients keep uploading large files.
+// Start the server first, then run e.g. MixedWorkloadBench --bulk-clients 8 --file-mb 256 --duration-s 30
+#define WIN32_LEAN_AND_MEAN
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include "../Client/ClientProtocol.h"
+
+using namespace std;
+
+struct BenchConfig {
+    int port = 55555;
+    int bulkClients = 4;
+    int fileMegabytes = 64;
+    int chatIntervalMs = 20;
+    int durationSeconds = 10;
+};
+
+//Connects and runs the same key exchange as Client.cpp, returns INVALID_SOCKET on failure
+static SOCKET connectSession(int port, uint64_t& secret) {
+    SOCKET clientSocket = connectToServer(port);
+    if (clientSocket == INVALID_SOCKET) {
+        cout << "connect() failed " << WSAGetLastError() << endl;
+        return INVALID_SOCKET;
+    }
+    if (!clientHandshake(clientSocket, secret)) {
+        cout << "Handshake failed " << WSAGetLastError() << endl;
+        closesocket(clientSocket);
+        return INVALID_SOCKET;
+    }
+    return clientSocket;
+}
+
+static void stopSession(SOCKET clientSocket) {
+    send(clientSocket, "STOP", 4, 0);
+    closesocket(clientSocket);
+}
+
+//Uploads synthetic files back to back until the benchmark ends
+static void bulkUploader(const BenchConfig& config, atomic<bool>& running, atomic<uint64_t>& bytesUploaded) {
+    uint64_t secret;
+    SOCKET clientSocket = connectSession(config.port, secret);
+    if (clientSocket == INVALID_SOCKET) {
+        return;
+    }
+
+    streampos fileSize = static_cast<streamoff>(config.fileMegabytes) * 1024 * 1024;
+    char plainChunk[CHUNK_SIZE];
+    for (int i = 0; i < CHUNK_SIZE; i++) {
+        plainChunk[i] = static_cast<char>(i);
+    }
+
+    char recieveConf[32];
+    SocketTransport transport{ clientSocket };
+    auto readChunk = [&](uint32_t index, char* chunkBuffer) {
+        int chunkBytes = static_cast<int>(min<streamoff>(fileSize - static_cast<streamoff>(index) * CHUNK_SIZE, CHUNK_SIZE));
+        memcpy(chunkBuffer, plainChunk, chunkBytes);
+        bytesUploaded += chunkBytes;
+        return chunkBytes;
+    };
+
+    while (running) {
+        if (!sendRequest(clientSocket, "SEND", recieveConf) || !sendFileHeader(clientSocket, fileSize, "bin") ||
+            !sendFileBody(transport, fileSize, readChunk, secret) ||
+            !recvAll(clientSocket, recieveConf, sizeof(recieveConf))) {
+            break;
+        }
+    }
+    stopSession(clientSocket);
+}
+
+//Sends one CHAT message every chatIntervalMs. Latency is measured from the time the message was due rather than
+//the time it was actually sent, so a stalled server isn't hidden by the chat client falling behind its schedule.
+static void chatter(const BenchConfig& config, atomic<bool>& running, vector<double>& latenciesMs) {
+    uint64_t secret;
+    SOCKET clientSocket = connectSession(config.port, secret);
+    if (clientSocket == INVALID_SOCKET) {
+        return;
+    }
+
+    const char message[] = "ping from MixedWorkloadBench";
+    char sendBuffer[sizeof(uint32_t) + sizeof(message)];
+    char recieveConf[32];
+    auto interval = chrono::milliseconds(config.chatIntervalMs);
+    auto dueTime = chrono::steady_clock::now();
+
+    while (running) {
+        this_thread::sleep_until(dueTime);
+
+        memcpy(sendBuffer + sizeof(uint32_t), message, sizeof(message));
+        int frameBytes = buildChatFrame(sendBuffer, sizeof(message), secret);
+
+        if (!sendRequest(clientSocket, "CHAT", recieveConf) ||
+            send(clientSocket, sendBuffer, frameBytes, 0) == SOCKET_ERROR ||
+            !recvAll(clientSocket, recieveConf, sizeof(recieveConf))) {
+            cout << "Chat session failed " << WSAGetLastError() << endl;
+            break;
+        }
+
+        chrono::duration<double, milli> latency = chrono::steady_clock::now() - dueTime;
+        latenciesMs.push_back(latency.count());
+        dueTime += interval;
+    }
+    stopSession(clientSocket);
+}
+
+static double percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+int main(int argc, char* argv[])
+{
+    BenchConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--port") == 0) config.port = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--bulk-clients") == 0) config.bulkClients = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--file-mb") == 0) config.fileMegabytes = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--chat-interval-ms") == 0) config.chatIntervalMs = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--duration-s") == 0) config.durationSeconds = atoi(argv[i + 1]);
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cout << "Winsock dll not found" << endl;
+        return 0;
+    }
+    srand(time(0));
+
+    cout << "Running " << config.bulkClients << " uploaders of " << config.fileMegabytes << " MB files and one chat client every "
+        << config.chatIntervalMs << " ms for " << config.durationSeconds << " s" << endl;
+
+    atomic<bool> running{ true };
+    atomic<uint64_t> bytesUploaded{ 0 };
+    vector<double> latenciesMs;
+    vector<thread> clients;
+
+    for (int i = 0; i < config.bulkClients; i++) {
+        clients.emplace_back(bulkUploader, cref(config), ref(running), ref(bytesUploaded));
+    }
+    //Give the uploads a moment to fill the pool before chatting
+    this_thread::sleep_for(chrono::milliseconds(500));
+    clients.emplace_back(chatter, cref(config), ref(running), ref(latenciesMs));
+
+    //Bytes sent during the warmup are not part of the measured window
+    auto start = chrono::steady_clock::now();
+    uint64_t uploadedBeforeWindow = bytesUploaded;
+    this_thread::sleep_for(chrono::seconds(config.durationSeconds));
+    uint64_t uploadedInWindow = bytesUploaded - uploadedBeforeWindow;
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    running = false;
+
+    for (thread& client : clients) {
+        client.join();
+    }
+
+    sort(latenciesMs.begin(), latenciesMs.end());
+    cout << "chat messages: " << latenciesMs.size() << endl;
+    cout << "chat latency ms p50: " << percentile(latenciesMs, 50) << " p90: " << percentile(latenciesMs, 90)
+        << " p99: " << percentile(latenciesMs, 99) << " max: " << (latenciesMs.empty() ? 0 : latenciesMs.back()) << endl;
+    cout << "bulk upload MB/s: " << uploadedInWindow / (1024.0 * 1024.0) / elapsed.count() << endl;
+
+    WSACleanup();
+    return 0;
+}
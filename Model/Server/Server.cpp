@@ -7,251 +7,1210 @@
 #include <thread>
 #include <vector>
 #include <mutex>
-#include <condition_variable>
-#include <queue>
 #include <functional>
 #include <chrono>
-#include <iomanip>
-#include <sstream>
 #include <string>
-#include <future>
 #include <fstream>
+#include <atomic>
+#include <unordered_map>
+#include <coroutine>
+#include <utility>
+#include <memory>
+#include <filesystem>
+#include <random>
+#include "ServerCore.h"
+#include "ThreadPool.h"
+#include "ShmRing.h"
+#include "DiffieHellman.h"
+#include "Crc32c.h"
+#include "BatchProtocol.h"
 #define MAX_BUFFER 1024*1024
 #define CHUNK_SIZE 1024
+//Times an upload may ask for chunks that failed their checksum before it's given up
+#define MAX_RETRANSMIT_ROUNDS 3
+//Largest SEND the server takes, chunk indices of the retransmit requests are 32 bit
+#define MAX_UPLOAD_BYTES (1024LL * 1024 * 1024 * 1024)
+//Corrupt chunks one upload may have waiting for their retransmit before it's given up
+#define MAX_CORRUPT_CHUNKS 4096
 
 using namespace std;
 
-class ThreadPool {
-private:
+struct SchedulerConfig {
+    //Interactive frames should go out within this time even while uploads keep every worker busy. An upload
+    //quantum never runs longer than this before handing the worker back to the queue
+    chrono::milliseconds latencyTarget{ 10 };
+    //Maximum number of upload bytes handled by one bulk quantum. Every active upload gets the same quantum per
+    //turn of the bulk queue which shares the bandwidth fairly between concurrent uploads
+    int bulkQuantumBytes = 64 * CHUNK_SIZE;
+};
 
-    vector<thread> threads;
-    queue<function<void()>> tasks;
-    mutex task_mutex;
-    condition_variable mutex_condition;
-    bool should_terminate = false;
+enum class PollInterest {
+    Read,
+    Write
+};
+
+//Event loop of the server. Waits until sockets of suspended sessions become readable or writable so that no
+//worker sits blocked in recv()/send(). WSAPoll is used rather than select() so the number of sessions isn't
+//capped by FD_SETSIZE. A socket is armed for a single wakeup: once it is ready it is removed
+//from the poll set and its callback is queued on the pool with the priority and worker it was armed with.
+class SessionPoller {
+private:
+    struct Waiter {
+        PollInterest interest;
+        TaskPriority priority;
+        int worker;
+        function<void()> onReady;
+    };
+
+    ThreadPool& pool;
+    unordered_map<SOCKET, Waiter> waiters;
+    mutex waiter_mutex;
+    //WSAPoll only waits on sockets, so Arm() wakes the poller up by sending a datagram to this
+    //loopback socket which is always part of the poll set
+    SOCKET wakeSocket = INVALID_SOCKET;
+    sockaddr_in wakeAddress = {};
+    thread pollThread;
+    atomic<bool> should_terminate{ false };
 
 public:
-    //Intializing with the max number of threads supported by the hardware
-    void Start() {
-        int num_threads = thread::hardware_concurrency();
-        for (int i = 0; i < num_threads; i++) {
-            //Why Not Just the Function Name? A member function is not a standalone function, it is bound to an 
-            // instance of its class. ThreadLoop on its own doesnt know which instance of the class it should operate on.
-            threads.emplace_back(thread(&ThreadPool::ThreadLoop, this));
+    explicit SessionPoller(ThreadPool& threadPool) : pool(threadPool) {}
+
+    bool Start() {
+        wakeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (wakeSocket == INVALID_SOCKET) {
+            std::cout << "Error while creating poller wake socket " << WSAGetLastError() << endl;
+            return false;
+        }
+        wakeAddress.sin_family = AF_INET;
+        InetPton(AF_INET, _T("127.0.0.1"), &wakeAddress.sin_addr.s_addr);
+        wakeAddress.sin_port = 0;
+        //Port 0 lets the OS pick a free port, getsockname tells us which one so we can send to ourselves
+        int addressLength = sizeof(wakeAddress);
+        if (::bind(wakeSocket, (SOCKADDR*)&wakeAddress, sizeof(wakeAddress)) == SOCKET_ERROR ||
+            getsockname(wakeSocket, (SOCKADDR*)&wakeAddress, &addressLength) == SOCKET_ERROR) {
+            std::cout << "Error while binding poller wake socket " << WSAGetLastError() << endl;
+            closesocket(wakeSocket);
+            wakeSocket = INVALID_SOCKET;
+            return false;
         }
-        std::cout << "Thread pool started with " << threads.size() << " threads." << std::endl;
+        pollThread = thread(&SessionPoller::PollLoop, this);
+        return true;
     }
 
-    void ThreadLoop() {
-        //while loop so that the thread is continously active
-        while (true) {
-            function<void()> task;
+    void Arm(SOCKET socket, PollInterest interest, TaskPriority priority, int worker, function<void()> onReady) {
+        {
+            unique_lock<std::mutex> lock(waiter_mutex);
+            waiters[socket] = Waiter{ interest, priority, worker, move(onReady) };
+        }
+        Wake();
+    }
+
+    void Wake() {
+        char signal = 0;
+        sendto(wakeSocket, &signal, 1, 0, (SOCKADDR*)&wakeAddress, sizeof(wakeAddress));
+    }
+
+    void PollLoop() {
+        vector<WSAPOLLFD> pollSet;
+        while (!should_terminate) {
+            pollSet.clear();
+            pollSet.push_back(WSAPOLLFD{ wakeSocket, POLLRDNORM, 0 });
             {
-                unique_lock<std::mutex> lock(task_mutex);
-                //waiting on the condition: If the tasks queue is empty then thread goes to sleep and release the lock
-                //so that any other thread can acquire it 
-                mutex_condition.wait(lock, [this] {
-                    return !tasks.empty() || should_terminate;
-                    });
-                //if the programm is to terminate we should go through and return exiting out of the loop
-                if (should_terminate) {
-                    return;
+                unique_lock<std::mutex> lock(waiter_mutex);
+                for (auto& waiter : waiters) {
+                    short events = waiter.second.interest == PollInterest::Read ? POLLRDNORM : POLLWRNORM;
+                    pollSet.push_back(WSAPOLLFD{ waiter.first, events, 0 });
                 }
-                task = tasks.front();
-                tasks.pop();
-                std::cout << "Task picked by thread: " << this_thread::get_id() << endl;
             }
-            task();
-      
-        }
-    }
 
-    /*Templates allow the QueueTask method to accept any callable object(e.g., functions, lambdas, or functors)
-    with any number of parameters and any return type.
-    1) F is the callable function type (e.g., a lambda or function pointer).
-    2) Args... represents the parameter types for the callable.
-    3) decltype(func(args...)) deduces the return type of the callable.
-    The thread pool queues tasks to be executed asynchronously, Without std::future, you'd have to block the main
-    thread until the task completes, defeating the purpose of asynchronous execution.
-    The && in F&& func and Args&&... args represents perfect forwarding,
-    Perfect forwarding ensures that:
-    1)If you pass an lvalue(e.g., a variable), it is passed as value to the callable.
-    2)If you pass an rvalue(e.g., a temporary object), it is passed as reference to the callable.*/
-    template<typename  F, typename ... Args>
-    auto QueueTask(F&& func, Args&&... args) -> future<decltype(func(args...))> {
+            if (WSAPoll(pollSet.data(), static_cast<ULONG>(pollSet.size()), -1) == SOCKET_ERROR) {
+                std::cout << "Poller WSAPoll error " << WSAGetLastError() << endl;
+                continue;
+            }
+
+            if (pollSet[0].revents != 0) {
+                char signal;
+                recv(wakeSocket, &signal, 1, 0);
+            }
 
-        using return_type = decltype(func(args...));
+            //A hang up or error also counts as ready, the session sees it on its next recv/send
+            vector<Waiter> ready;
+            {
+                unique_lock<std::mutex> lock(waiter_mutex);
+                for (size_t i = 1; i < pollSet.size(); i++) {
+                    if (pollSet[i].revents == 0) {
+                        continue;
+                    }
+                    auto waiter = waiters.find(pollSet[i].fd);
+                    if (waiter != waiters.end()) {
+                        ready.push_back(move(waiter->second));
+                        waiters.erase(waiter);
+                    }
+                }
+            }
+            for (Waiter& waiter : ready) {
+                pool.Post(waiter.priority, move(waiter.onReady), waiter.worker);
+            }
+        }
+    }
 
-        /*is used to wrap the callable object. This lets us execute the function later while associating its
-        result with a std::future. It gives us a shared pointer "task". The function and its arguments are
-        bound together using std::bind*/
+    ~SessionPoller() {
+        should_terminate = true;
+        if (pollThread.joinable()) {
+            Wake();
+            pollThread.join();
+        }
+        if (wakeSocket != INVALID_SOCKET) {
+            closesocket(wakeSocket);
+        }
+    }
+};
 
-        auto task = make_shared<packaged_task<return_type()>>(bind(forward<F>(func), forward<Args>(args)...));
+//Coroutine frames are carved out of a few fixed size classes and recycled, so a suspended session costs one
+//pooled block (plus one per pending I/O operation) instead of a whole thread stack
+class FramePool {
+private:
+    static const int NUM_CLASSES = 5;
+    static constexpr size_t CLASS_SIZES[NUM_CLASSES] = { 256, 512, 1024, 2048, 4096 };
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    FreeBlock* free_lists[NUM_CLASSES] = {};
+    mutex pool_mutex;
+
+    static int SizeClass(size_t size) {
+        for (int i = 0; i < NUM_CLASSES; i++) {
+            if (size <= CLASS_SIZES[i]) {
+                return i;
+            }
+        }
+        return -1;
+    }
 
-        future<return_type> result = task->get_future();
+public:
+    static FramePool& Instance() {
+        static FramePool framePool;
+        return framePool;
+    }
 
-        /*block scoping this will automatically release the lock (functionality of unique_lock as it releases the
-        lock when the scope ends*/
+    void* Allocate(size_t size) {
+        int sizeClass = SizeClass(size);
+        if (sizeClass < 0) {
+            return ::operator new(size);
+        }
         {
-            unique_lock<std::mutex> lock(task_mutex);
-            /*[task]() { (*task)(); } is a lambda function that :
-            1) Captures the task shared pointer by value([task]).
-            2) Dereferences the task pointer and invokes the callable((*task)()).
-            Why is this necessary? The queue stores generic tasks as std::function<void()>. To convert the
-            actual task (which might take arguments and return values) into this format, we wrap it inside a
-            lambda.*/
-            tasks.push([task]() { (*task)(); });
+            unique_lock<std::mutex> lock(pool_mutex);
+            if (FreeBlock* block = free_lists[sizeClass]) {
+                free_lists[sizeClass] = block->next;
+                return block;
+            }
         }
+        return ::operator new(CLASS_SIZES[sizeClass]);
+    }
 
+    void Free(void* frame, size_t size) {
+        int sizeClass = SizeClass(size);
+        if (sizeClass < 0) {
+            ::operator delete(frame);
+            return;
+        }
+        unique_lock<std::mutex> lock(pool_mutex);
+        FreeBlock* block = static_cast<FreeBlock*>(frame);
+        block->next = free_lists[sizeClass];
+        free_lists[sizeClass] = block;
+    }
+};
+
+struct PooledPromise {
+    static void* operator new(size_t size) {
+        return FramePool::Instance().Allocate(size);
+    }
+    static void operator delete(void* frame, size_t size) {
+        FramePool::Instance().Free(frame, size);
+    }
+};
 
-        //Notifying any sleeping thread that there is some task available. Ig it won't matter if I use notify_all
-        mutex_condition.notify_one();
-        return result;
+template<typename T = void>
+class Task;
+
+/*Task<T> is a lazily started coroutine: nothing runs until it is co_await-ed. The awaiting coroutine is stored as
+the continuation and the task's final_suspend jumps straight back into it (symmetric transfer), so a chain of
+tasks that complete without blocking doesn't bounce through the pool.*/
+struct TaskPromiseBase : PooledPromise {
+    coroutine_handle<> continuation;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template<typename Promise>
+        coroutine_handle<> await_suspend(coroutine_handle<Promise> finished) noexcept {
+            coroutine_handle<> next = finished.promise().continuation;
+            return next ? next : noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() {
+        std::cout << "Unhandled exception in session coroutine" << endl;
+        terminate();
     }
+};
 
-    ~ThreadPool() {
-        {
-            unique_lock<std::mutex> lock(task_mutex);
-            should_terminate = true;
+template<typename T>
+struct TaskPromise : TaskPromiseBase {
+    T value{};
+    Task<T> get_return_object();
+    void return_value(T result) { value = move(result); }
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+};
+
+template<typename T>
+class Task {
+public:
+    using promise_type = TaskPromise<T>;
+
+    explicit Task(coroutine_handle<promise_type> coroutine) : handle(coroutine) {}
+    Task(Task&& other) noexcept : handle(exchange(other.handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle) {
+            handle.destroy();
         }
-        //notifying all the sleeping threads that should_terminate it true quickly finish your job and come out of
-        //your while loops
-        mutex_condition.notify_all();
-        //Blocking the main thread till each thread is done and dusted with it's work
-        for (thread& active_thread : threads) {
-            active_thread.join();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() {
+        if constexpr (!is_void_v<T>) {
+            return move(handle.promise().value);
         }
-        threads.clear();
     }
+
+private:
+    coroutine_handle<promise_type> handle;
 };
 
-//Helper
-static bool isPrime(int num) {
-    if (num <= 1) return false;
-    for (int i = 2; i <= sqrt(num); i++) {
-        if (num % i == 0) return false;
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+//Moves the awaiting coroutine onto a pool worker of the given scheduling class, the session's home worker if it
+//has one. Also used by long running sessions to give the worker back to the queue between two quanta.
+struct ScheduleOn {
+    ThreadPool& pool;
+    TaskPriority priority;
+    int worker = ThreadPool::ANY_WORKER;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> awaiting) {
+        pool.Post(priority, [awaiting]() { awaiting.resume(); }, worker);
     }
-    return true;
+    void await_resume() const noexcept {}
+};
+
+//Top level coroutine owning a session. It starts on a pool worker and frees itself when the session ends.
+struct DetachedTask {
+    struct promise_type : PooledPromise {
+        DetachedTask get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {
+            std::cout << "Unhandled exception in session coroutine" << endl;
+            terminate();
+        }
+    };
+};
+
+//worker comes from pool.AcquireWorker() and is given back when the session ends
+static DetachedTask spawn(ThreadPool& pool, int worker, Task<> task) {
+    co_await ScheduleOn{ pool, TaskPriority::Interactive, worker };
+    co_await task;
+    pool.ReleaseWorker(worker);
 }
 
-static int generateRandomPrime(int lower, int upper) {
-    if (lower > upper) swap(lower, upper);
-    vector<int> primes;
+//Byte stream a session talks over: the client's TCP socket or, after a SHMO request, a shared memory segment
+class SessionStream {
+public:
+    virtual ~SessionStream() = default;
+
+    //Same contract as ::recv: bytes received, 0 once the peer closed the connection or SOCKET_ERROR
+    virtual Task<int> recv(char* buffer, int length) = 0;
+
+    //Sends the whole buffer, false if the connection failed on the way
+    virtual Task<bool> send(const char* buffer, int length) = 0;
+
+    //Scheduling class used to resume the owning coroutine after it waited on this stream
+    virtual void SetPriority(TaskPriority newPriority) = 0;
+
+    //Pool worker the session is bound to, where the owning coroutine is resumed after it waited on this stream
+    int HomeWorker() const { return homeWorker; }
 
-    for (int i = lower; i <= upper; i++) {
-        if (isPrime(i)) {
-            primes.push_back(i);
+    Task<bool> recvAll(char* buffer, int length) {
+        int received = 0;
+        while (received < length) {
+            int bytes = co_await recv(buffer + received, length - received);
+            if (bytes == SOCKET_ERROR || bytes == 0) {
+                co_return false;
+            }
+            received += bytes;
         }
+        co_return true;
     }
 
-    if (primes.empty()) {
-        cout << "No prime numbers in the given range!" << endl;
-        return -1;
+protected:
+    explicit SessionStream(int worker) : homeWorker(worker) {}
+
+private:
+    int homeWorker;
+};
+
+//Non-blocking socket whose operations suspend the calling coroutine instead of the thread. When the socket
+//isn't ready the coroutine is parked in the poller and resumed by a worker of the socket's current priority.
+class AsyncSocket : public SessionStream {
+private:
+    SOCKET socket;
+    SessionPoller& poller;
+    TaskPriority priority = TaskPriority::Interactive;
+
+    struct ReadyAwaiter {
+        AsyncSocket& owner;
+        PollInterest interest;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> awaiting) {
+            owner.poller.Arm(owner.socket, interest, owner.priority, owner.HomeWorker(), [awaiting]() { awaiting.resume(); });
+        }
+        void await_resume() const noexcept {}
+    };
+
+    static bool WouldBlock(int result) {
+        return result == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK;
     }
 
-    srand(time(0));
-    int randomIndex = rand() % primes.size();
-    return primes[randomIndex];
-}
+public:
+    AsyncSocket(SOCKET acceptSocket, SessionPoller& sessionPoller, int worker)
+        : SessionStream(worker), socket(acceptSocket), poller(sessionPoller) {
+        u_long nonBlocking = 1;
+        ioctlsocket(socket, FIONBIO, &nonBlocking);
+    }
+    AsyncSocket(const AsyncSocket&) = delete;
+    AsyncSocket& operator=(const AsyncSocket&) = delete;
+    ~AsyncSocket() {
+        closesocket(socket);
+    }
+
+    SOCKET Handle() const { return socket; }
+
+    void SetPriority(TaskPriority newPriority) override { priority = newPriority; }
 
-static uint64_t mod_exp(uint16_t base, uint16_t exp, uint16_t mod) {
-    uint64_t result = 1;
-    base = base % mod;
-    while (exp > 0) {
-        if (exp % 2 == 1) { // If exp is odd
-            result = (result * base) % mod;
+    Task<int> recv(char* buffer, int length) override {
+        while (true) {
+            int bytes = ::recv(socket, buffer, length, 0);
+            if (!WouldBlock(bytes)) {
+                co_return bytes;
+            }
+            co_await ReadyAwaiter{ *this, PollInterest::Read };
         }
-        exp = exp >> 1; // Divide exp by 2
-        base = (base * base) % mod;
     }
-    return result;
-}
 
-static void encrypt(char* sendBuffer, int size, uint64_t key) {
-    for (size_t i = 0; i < size; i++) {
-        sendBuffer[i] ^= (key >> (8 * (i % 8))) & 0xFF;
+    Task<bool> send(const char* buffer, int length) override {
+        int sent = 0;
+        while (sent < length) {
+            int bytes = ::send(socket, buffer + sent, length - sent, 0);
+            if (WouldBlock(bytes)) {
+                co_await ReadyAwaiter{ *this, PollInterest::Write };
+                continue;
+            }
+            if (bytes == SOCKET_ERROR) {
+                co_return false;
+            }
+            sent += bytes;
+        }
+        co_return true;
+    }
+};
+
+//Session stream over the rings of a shared memory segment, used by clients on this machine that sent SHMO.
+//CHAT and file data are copied once into the ring and out of it, no socket call per message. Waits on the
+//segment's events are registered with the system thread pool, whose callback hands the parked coroutine to our
+//pool like the poller does for sockets. The events are only signalled while this side sleeps.
+class ShmStream : public SessionStream {
+private:
+    ThreadPool& pool;
+    ShmSegment segment;
+    HANDLE clientProcess = nullptr;
+    HANDLE dataWait = nullptr;
+    HANDLE spaceWait = nullptr;
+    HANDLE exitWait = nullptr;
+    //Set by the session, read by OnRingEvent on a thread of the system pool
+    atomic<TaskPriority> priority{ TaskPriority::Interactive };
+    //Coroutine sleeping on one of the rings, taken by whichever of the waker and the waiter gets it first
+    atomic<void*> parked{ nullptr };
+
+    static VOID CALLBACK OnRingEvent(PVOID context, BOOLEAN) {
+        ShmStream* stream = static_cast<ShmStream*>(context);
+        void* awaiting = stream->parked.exchange(nullptr);
+        if (awaiting != nullptr) {
+            stream->pool.Post(stream->priority.load(), [awaiting]() { coroutine_handle<>::from_address(awaiting).resume(); },
+                stream->HomeWorker());
+        }
+    }
+
+    //A client that exits without closing the rings would leave its session parked forever, close them for it
+    static VOID CALLBACK OnClientExit(PVOID context, BOOLEAN) {
+        ShmStream* stream = static_cast<ShmStream*>(context);
+        stream->segment.ToServer().Close();
+        stream->segment.ToClient().Close();
+    }
+
+    struct RingAwaiter {
+        ShmStream& owner;
+        //Waiting for data on the client's ring or for space on ours
+        bool forData;
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(coroutine_handle<> awaiting) {
+            //A stale wakeup may resume the coroutine, and with it destroy this awaiter, as soon as the handle is
+            //published, so only locals are used from there on
+            ShmStream* stream = &owner;
+            bool waitForData = forData;
+            stream->parked.store(awaiting.address());
+            bool sleep = waitForData ? stream->segment.ToServer().PrepareWaitForData()
+                : stream->segment.ToClient().PrepareWaitForSpace();
+            if (sleep) {
+                return true;
+            }
+            //The ring became ready before we slept: carry on only if the handle is still ours to take back
+            void* expected = awaiting.address();
+            return !stream->parked.compare_exchange_strong(expected, nullptr);
+        }
+        void await_resume() const noexcept {}
+    };
+
+public:
+    ShmStream(ThreadPool& threadPool, int worker) : SessionStream(worker), pool(threadPool) {}
+    ShmStream(const ShmStream&) = delete;
+    ShmStream& operator=(const ShmStream&) = delete;
+
+    //Waits for running callbacks before the segment goes away, the segment then closes both rings
+    ~ShmStream() {
+        for (HANDLE wait : { exitWait, dataWait, spaceWait }) {
+            if (wait != nullptr) {
+                UnregisterWaitEx(wait, INVALID_HANDLE_VALUE);
+            }
+        }
+        if (clientProcess != nullptr) {
+            CloseHandle(clientProcess);
+        }
+    }
+
+    //Creates the segment under the given name prefix for the client process clientProcessId
+    bool Open(const string& name, uint32_t clientProcessId) {
+        if (!segment.Create(name)) {
+            return false;
+        }
+        clientProcess = OpenProcess(SYNCHRONIZE, FALSE, clientProcessId);
+        return clientProcess != nullptr &&
+            RegisterWaitForSingleObject(&dataWait, segment.ToServer().DataEvent(), OnRingEvent, this, INFINITE,
+                WT_EXECUTEDEFAULT) &&
+            RegisterWaitForSingleObject(&spaceWait, segment.ToClient().SpaceEvent(), OnRingEvent, this, INFINITE,
+                WT_EXECUTEDEFAULT) &&
+            RegisterWaitForSingleObject(&exitWait, clientProcess, OnClientExit, this, INFINITE, WT_EXECUTEONLYONCE);
+    }
+
+    void SetPriority(TaskPriority newPriority) override { priority = newPriority; }
+
+    Task<int> recv(char* buffer, int length) override {
+        while (true) {
+            int bytes = segment.ToServer().TryRead(buffer, length);
+            if (bytes != 0) {
+                co_return bytes < 0 ? 0 : bytes;
+            }
+            co_await RingAwaiter{ *this, true };
+        }
+    }
+
+    Task<bool> send(const char* buffer, int length) override {
+        while (length > 0) {
+            int bytes = segment.ToClient().TryWrite(buffer, length);
+            if (bytes < 0) {
+                co_return false;
+            }
+            if (bytes == 0) {
+                co_await RingAwaiter{ *this, false };
+                continue;
+            }
+            buffer += bytes;
+            length -= bytes;
+        }
+        co_return true;
+    }
+};
+
+//Output file whose writes are collected in memory and flushed to disk by a bulk task, so the session
+//coroutine never blocks an I/O worker on the disk. The flushes run on the session's home worker and the buffer
+//is allocated on that worker's NUMA node.
+class AsyncFile {
+private:
+    static const int WRITE_BUFFER_SIZE = 64 * CHUNK_SIZE;
+
+    ThreadPool& pool;
+    int worker;
+    fstream file;
+    NodeBuffer buffer;
+    int used = 0;
+
+    struct WriteAwaiter {
+        AsyncFile& owner;
+        const char* data;
+        int size;
+
+        //Small writes are only copied into the buffer, the coroutine suspends once the buffer is full.
+        //A null data pointer flushes the buffer.
+        bool await_ready() {
+            if (data == nullptr) {
+                return owner.used == 0;
+            }
+            if (owner.used + size > WRITE_BUFFER_SIZE) {
+                return false;
+            }
+            memcpy(owner.buffer.data() + owner.used, data, size);
+            owner.used += size;
+            return true;
+        }
+        void await_suspend(coroutine_handle<> awaiting) {
+            owner.pool.Post(TaskPriority::Bulk, [this, awaiting]() {
+                owner.file.write(owner.buffer.data(), owner.used);
+                if (data != nullptr) {
+                    owner.file.write(data, size);
+                }
+                owner.used = 0;
+                awaiting.resume();
+                }, owner.worker);
+        }
+        bool await_resume() const { return !owner.file.fail(); }
+    };
+
+public:
+    AsyncFile(ThreadPool& threadPool, int homeWorker) : pool(threadPool), worker(homeWorker) {}
+
+    //Fails if the file already exists instead of overwriting it
+    bool open(const string& filename) {
+        HANDLE created = CreateFileA(filename.c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (created == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        CloseHandle(created);
+        file.open(filename, ios::binary | ios::out);
+        buffer = NodeBuffer(WRITE_BUFFER_SIZE, pool.CurrentNode());
+        return file.is_open() && buffer.data() != nullptr;
+    }
+
+    WriteAwaiter write(const char* data, int size) {
+        return WriteAwaiter{ *this, data, size };
+    }
+
+    WriteAwaiter flush() {
+        return WriteAwaiter{ *this, nullptr, 0 };
+    }
+
+    //Overwrites size bytes at offset, for chunks sent again after failing their checksum. Only used once all
+    //sequential writes are done.
+    Task<bool> writeAt(streamoff offset, const char* data, int size) {
+        co_await flush();
+        file.seekp(offset);
+        bool written = co_await write(data, size) && co_await flush();
+        file.seekp(0, ios::end);
+        co_return written;
+    }
+
+    //Writes whatever is still buffered and closes the file
+    Task<bool> close() {
+        co_await flush();
+        file.close();
+        co_return !file.fail();
+    }
+};
+
+struct SessionContext {
+    ThreadPool& pool;
+    //CPU stage for the key exchange, kept apart so handshakes can't hold up the I/O workers
+    ThreadPool& handshakePool;
+    SessionPoller& poller;
+    SchedulerConfig config;
+};
+
+//Receives the body of a SEND request. The session runs as bulk work while the upload lasts and gives its
+//worker back after bulkQuantumBytes, after the latency target or as soon as an interactive task is waiting.
+//Every quantum goes to the back of the bulk queue which shares the workers fairly between uploads.
+//Every chunk is followed by the CRC32C of its plain bytes and the last one by the CRC32C of the whole file.
+//Chunks that fail their check are asked for again, up to MAX_RETRANSMIT_ROUNDS times, before the file digest
+//is compared and the confirmation goes out. The digest is folded as the chunks arrive, only the corrupt chunks
+//(at most MAX_CORRUPT_CHUNKS) are remembered until the end.
+static Task<bool> receiveFile(SessionContext& context, SessionStream& stream, uint64_t secret) {
+    // Receive file size and extension first
+    streampos fileSize;
+    char extension[16];
+
+    if (!co_await stream.recvAll(reinterpret_cast<char*>(&fileSize), sizeof(fileSize)) ||
+        !co_await stream.recvAll(extension, 16)) {
+        std::cout << "Error receiving file size: " << WSAGetLastError() << endl;
+        co_return false;
+    }
+    extension[15] = '\0';
+
+    //A size the server won't take ends the session before any of the body is read
+    streamoff announcedSize = fileSize;
+    if (announcedSize < 0 || announcedSize > MAX_UPLOAD_BYTES) {
+        std::cout << "Refusing upload of " << announcedSize << " bytes" << endl;
+        co_return false;
     }
+    uint64_t fileBytes = static_cast<uint64_t>(announcedSize);
+
+    string filename = getCurrentTimeFilename(extension);
+    AsyncFile file(context.pool, stream.HomeWorker());
+
+    if (!file.open(filename)) {
+        std::cout << "Error opening file " << filename << ": " << GetLastError() << endl;
+        co_return false;
+    }
+
+    std::cout << "Receiving file: " << filename << ", Size: " << fileBytes << " bytes" << endl;
+
+    stream.SetPriority(TaskPriority::Bulk);
+    co_await ScheduleOn{ context.pool, TaskPriority::Bulk, stream.HomeWorker() };
+
+    //Chunk followed by its checksum
+    char chunkFrame[CHUNK_SIZE + CHUNK_CRC_SIZE];
+    uint64_t totalBytesReceived = 0;
+    //Cleared by the first write that fails, the upload can't be confirmed then
+    bool written = true;
+    auto quantumStart = chrono::steady_clock::now();
+    int quantumBytes = 0;
+    //File digest so far. A corrupt chunk goes in as 0 and its CRC once it came again is added at the end,
+    //which works as the CRC is linear in the chunk CRCs.
+    uint32_t digest = 0;
+    uint64_t chunkCount = (fileBytes + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    static const Crc32cCombiner chunkCombiner(CHUNK_SIZE);
+    int lastBytes = static_cast<int>(fileBytes - (chunkCount == 0 ? 0 : (chunkCount - 1) * CHUNK_SIZE));
+    unique_ptr<Crc32cCombiner> lastCombiner = lastBytes == CHUNK_SIZE ? nullptr : make_unique<Crc32cCombiner>(lastBytes);
+    auto combinerFor = [&](uint64_t index) -> const Crc32cCombiner& {
+        return index + 1 == chunkCount && lastCombiner ? *lastCombiner : chunkCombiner;
+    };
+    uint32_t chunkIndex = 0;
+    vector<uint32_t> corruptChunks;
+    //Index and CRC of every chunk that was corrupt and came again intact
+    vector<pair<uint32_t, uint32_t>> repairedChunks;
+
+    //Decrypts a chunk frame and checks it against the checksum the client computed before encrypting
+    auto chunkIntact = [&](int chunkBytes, uint32_t& chunkCrc) {
+        decrypt(chunkFrame, chunkBytes, secret);
+        uint32_t expectedCrc;
+        memcpy(&expectedCrc, chunkFrame + chunkBytes, CHUNK_CRC_SIZE);
+        chunkCrc = crc32c(chunkFrame, chunkBytes);
+        return chunkCrc == expectedCrc;
+    };
+
+    while (totalBytesReceived < fileBytes) {
+        //The client encrypts every CHUNK_SIZE block on its own, so always receive whole chunks to decrypt them
+        int chunkBytes = static_cast<int>(min<uint64_t>(fileBytes - totalBytesReceived, CHUNK_SIZE));
+        if (!co_await stream.recvAll(chunkFrame, chunkBytes + CHUNK_CRC_SIZE)) {
+            std::cout << "Encountered error or client disconnected: " << WSAGetLastError() << endl;
+            break;
+        }
+        uint32_t chunkCrc;
+        if (!chunkIntact(chunkBytes, chunkCrc)) {
+            if (corruptChunks.size() == MAX_CORRUPT_CHUNKS) {
+                std::cout << "Too many corrupt chunks, giving the upload up" << endl;
+                break;
+            }
+            corruptChunks.push_back(chunkIndex);
+            chunkCrc = 0;
+        }
+        digest = combinerFor(chunkIndex).Combine(digest, chunkCrc);
+        chunkIndex++;
+
+        //A corrupt chunk is written too so the ones after it land at their offsets, it's overwritten later
+        if (!co_await file.write(chunkFrame, chunkBytes)) {
+            written = false;
+        }
+        totalBytesReceived += chunkBytes;
+        quantumBytes += chunkBytes;
+
+        if (quantumBytes >= context.config.bulkQuantumBytes || context.pool.HasInteractivePending() ||
+            chrono::steady_clock::now() - quantumStart >= context.config.latencyTarget) {
+            // Optional: Show progress
+            std::cout << "Received " << totalBytesReceived << "/" << fileBytes << " bytes" << endl;
+            co_await ScheduleOn{ context.pool, TaskPriority::Bulk, stream.HomeWorker() };
+            quantumStart = chrono::steady_clock::now();
+            quantumBytes = 0;
+        }
+    }
+
+    uint32_t fileCrc = 0;
+    bool received = totalBytesReceived == fileBytes &&
+        co_await stream.recvAll(reinterpret_cast<char*>(&fileCrc), sizeof(fileCrc));
+
+    //Retransmit rounds: the number of corrupt chunks and their indices, answered with those chunk frames again.
+    //A count of 0 ends the upload, also when the rounds ran out with chunks still corrupt. That one goes out
+    //together with the confirmation.
+    for (int round = 0; received; round++) {
+        uint32_t requested = round < MAX_RETRANSMIT_ROUNDS ? static_cast<uint32_t>(corruptChunks.size()) : 0;
+        if (requested == 0) {
+            break;
+        }
+        vector<uint32_t> request(1 + requested);
+        request[0] = requested;
+        copy(corruptChunks.begin(), corruptChunks.begin() + requested, request.begin() + 1);
+        if (!co_await stream.send(reinterpret_cast<const char*>(request.data()),
+            static_cast<int>(request.size() * sizeof(uint32_t)))) {
+            received = false;
+            break;
+        }
+        std::cout << "Requesting " << requested << " corrupt chunks again" << endl;
+
+        vector<uint32_t> stillCorrupt;
+        for (uint32_t index : corruptChunks) {
+            uint64_t offset = uint64_t(index) * CHUNK_SIZE;
+            int chunkBytes = static_cast<int>(min<uint64_t>(fileBytes - offset, CHUNK_SIZE));
+            if (!co_await stream.recvAll(chunkFrame, chunkBytes + CHUNK_CRC_SIZE)) {
+                received = false;
+                break;
+            }
+            uint32_t chunkCrc;
+            if (!chunkIntact(chunkBytes, chunkCrc)) {
+                stillCorrupt.push_back(index);
+                continue;
+            }
+            repairedChunks.push_back({ index, chunkCrc });
+            if (!co_await file.writeAt(static_cast<streamoff>(offset), chunkFrame, chunkBytes)) {
+                written = false;
+            }
+        }
+        corruptChunks.swap(stillCorrupt);
+    }
+
+    if (!co_await file.close()) {
+        written = false;
+    }
+    stream.SetPriority(TaskPriority::Interactive);
+    co_await ScheduleOn{ context.pool, TaskPriority::Interactive, stream.HomeWorker() };
+
+    //Per chunk checks passed, now the whole file: add the repaired chunks, each carried over the chunks after it,
+    //to the digest and compare with the client's
+    bool intact = received && written && corruptChunks.empty();
+    if (intact && !repairedChunks.empty()) {
+        sort(repairedChunks.begin(), repairedChunks.end());
+        uint32_t correction = 0;
+        size_t next = 0;
+        for (uint64_t index = repairedChunks[0].first; index < chunkCount; index++) {
+            uint32_t chunkCrc = next < repairedChunks.size() && repairedChunks[next].first == index ?
+                repairedChunks[next++].second : 0;
+            correction = combinerFor(index).Combine(correction, chunkCrc);
+        }
+        digest ^= correction;
+    }
+    if (intact) {
+        intact = digest == fileCrc;
+    }
+
+    //Empty retransmit request followed by the 32 byte confirmation, the client reads both however the upload ended
+    char reply[sizeof(uint32_t) + 32] = {};
+    if (!received) {
+        std::cout << "File transfer incomplete" << endl;
+        strcpy_s(reply + sizeof(uint32_t), 32, "File transfer failed");
+        co_await stream.send(reply, sizeof(reply));
+        co_return false;
+    }
+
+    if (intact) {
+        std::cout << "File received and saved as: " << filename << endl;
+        strcpy_s(reply + sizeof(uint32_t), 32, "Received file confirmation");
+    }
+    else if (!written) {
+        std::cout << "Error writing file: " << filename << endl;
+        strcpy_s(reply + sizeof(uint32_t), 32, "File transfer failed");
+    }
+    else {
+        std::cout << "File failed its integrity check: " << filename << endl;
+        strcpy_s(reply + sizeof(uint32_t), 32, "File transfer failed");
+    }
+
+    // Send confirmation
+    if (!co_await stream.send(reply, sizeof(reply))) {
+        std::cout << "Unable to process request " << WSAGetLastError() << endl;
+        co_return false;
+    }
+    co_return true;
 }
 
-static void decrypt(char* recieveBuffer, int size, uint64_t key) {
-    encrypt(recieveBuffer, size, key); // Same operation reverses the encryption
+//Writes the files of a batch upload. Every frame becomes one bulk task, so the files of consecutive frames are
+//written by several workers at once. Pieces carry their offset, a file split over frames is written in whatever
+//order its tasks run and closed once all of its bytes are in.
+class BatchWriter {
+private:
+    struct BatchFile {
+        mutex file_mutex;
+        string path;
+        uint64_t size = 0;
+        uint64_t written = 0;
+        fstream file;
+        bool failed = false;
+    };
+
+    struct Piece {
+        shared_ptr<BatchFile> file;
+        uint32_t fileId;
+        uint64_t offset;
+        const char* data;
+        uint32_t length;
+    };
+
+    ThreadPool& pool;
+    string directory;
+    //Home worker of the session, the pieces themselves are written by any worker
+    int worker;
+    //Files with pieces still to come, only touched by the session coroutine
+    unordered_map<uint32_t, shared_ptr<BatchFile>> openFiles;
+
+    mutex writer_mutex;
+    vector<BatchFileStatus> finished;
+    int64_t pendingBytes = 0;
+    //Session waiting in Throttle() until pendingBytes drops to waitLimit
+    coroutine_handle<> waiter;
+    int64_t waitLimit = 0;
+
+    struct ThrottleAwaiter {
+        BatchWriter& owner;
+        int64_t limit;
+
+        bool await_ready() {
+            lock_guard<mutex> lock(owner.writer_mutex);
+            return owner.pendingBytes <= limit;
+        }
+        bool await_suspend(coroutine_handle<> awaiting) {
+            lock_guard<mutex> lock(owner.writer_mutex);
+            if (owner.pendingBytes <= limit) {
+                return false;
+            }
+            owner.waiter = awaiting;
+            owner.waitLimit = limit;
+            return true;
+        }
+        void await_resume() {}
+    };
+
+    //Relative path from the client, refused if it could leave the batch directory
+    static bool safePath(const string& relative) {
+        filesystem::path path = filesystem::path(relative).lexically_normal();
+        return !relative.empty() && !path.has_root_path() && *path.begin() != ".." && path.filename() != "..";
+    }
+
+    void WritePieces(const shared_ptr<vector<char>>& payload, const vector<Piece>& pieces) {
+        vector<BatchFileStatus> done;
+        for (const Piece& piece : pieces) {
+            BatchFile& file = *piece.file;
+            lock_guard<mutex> lock(file.file_mutex);
+            if (!file.failed) {
+                if (!file.file.is_open()) {
+                    error_code error;
+                    filesystem::create_directories(filesystem::path(file.path).parent_path(), error);
+                    file.file.open(file.path, ios::binary | ios::out);
+                }
+                file.file.seekp(piece.offset);
+                file.file.write(piece.data, piece.length);
+                file.failed = file.file.fail();
+            }
+            file.written += piece.length;
+            if (file.written == file.size) {
+                file.file.close();
+                done.push_back({ piece.fileId, file.failed ? 0u : 1u });
+            }
+        }
+
+        coroutine_handle<> resume;
+        {
+            lock_guard<mutex> lock(writer_mutex);
+            finished.insert(finished.end(), done.begin(), done.end());
+            pendingBytes -= payload->size();
+            if (waiter && pendingBytes <= waitLimit) {
+                resume = exchange(waiter, nullptr);
+            }
+        }
+        if (resume) {
+            pool.Post(TaskPriority::Bulk, [resume]() { resume.resume(); }, worker);
+        }
+    }
+
+public:
+    BatchWriter(ThreadPool& threadPool, const string& batchDirectory, int homeWorker)
+        : pool(threadPool), directory(batchDirectory), worker(homeWorker) {}
+
+    //Splits a decrypted frame into its pieces and queues them for writing. False if the frame is malformed.
+    bool Submit(shared_ptr<vector<char>> payload) {
+        vector<Piece> pieces;
+        size_t position = 0;
+        while (position < payload->size()) {
+            BatchRecordHeader record;
+            if (payload->size() - position < sizeof(record)) {
+                return false;
+            }
+            memcpy(&record, payload->data() + position, sizeof(record));
+            position += sizeof(record);
+            if (record.pathBytes > BATCH_MAX_PATH || payload->size() - position < uint64_t(record.pathBytes) + record.length ||
+                record.offset > record.fileSize || record.length > record.fileSize - record.offset) {
+                return false;
+            }
+
+            auto found = openFiles.find(record.fileId);
+            if (record.offset == 0 && found == openFiles.end()) {
+                string relative(payload->data() + position, record.pathBytes);
+                auto file = make_shared<BatchFile>();
+                file->path = directory + "/" + relative;
+                file->size = record.fileSize;
+                file->failed = !safePath(relative);
+                found = openFiles.emplace(record.fileId, file).first;
+            }
+            else if (found == openFiles.end() || record.pathBytes != 0) {
+                return false;
+            }
+            position += record.pathBytes;
+
+            pieces.push_back({ found->second, record.fileId, record.offset, payload->data() + position, record.length });
+            position += record.length;
+            if (record.offset + record.length == record.fileSize) {
+                openFiles.erase(found);
+            }
+        }
+
+        {
+            lock_guard<mutex> lock(writer_mutex);
+            pendingBytes += payload->size();
+        }
+        pool.Post(TaskPriority::Bulk, [this, payload, pieces = move(pieces)]() { WritePieces(payload, pieces); });
+        return true;
+    }
+
+    //Suspends the session while more than limit bytes wait for the disk, Throttle(0) waits for every write
+    ThrottleAwaiter Throttle(int64_t limit) {
+        return ThrottleAwaiter{ *this, limit };
+    }
+
+    //Files written (or failed) since the last call
+    vector<BatchFileStatus> TakeFinished() {
+        lock_guard<mutex> lock(writer_mutex);
+        return exchange(finished, {});
+    }
+
+    //Files whose remaining pieces never came, reported as failed at the end of the batch
+    vector<BatchFileStatus> TakeIncomplete() {
+        vector<BatchFileStatus> incomplete;
+        for (auto& [fileId, file] : openFiles) {
+            incomplete.push_back({ fileId, 0 });
+        }
+        openFiles.clear();
+        return incomplete;
+    }
+};
+
+//Bytes of decrypted frames a batch may have queued for the disk before the session stops reading
+static const int64_t BATCH_WRITE_BACKLOG = 8 * 1024 * 1024;
+
+static Task<bool> sendBatchAck(SessionStream& stream, uint32_t framesReceived, uint32_t resendFrom,
+    const vector<BatchFileStatus>& files, bool last) {
+    vector<char> ack(sizeof(BatchAck) + files.size() * sizeof(BatchFileStatus));
+    BatchAck header{ framesReceived, resendFrom, static_cast<uint32_t>(files.size()), last ? 1u : 0u };
+    memcpy(ack.data(), &header, sizeof(header));
+    if (!files.empty()) {
+        memcpy(ack.data() + sizeof(header), files.data(), files.size() * sizeof(BatchFileStatus));
+    }
+    co_return co_await stream.send(ack.data(), static_cast<int>(ack.size()));
 }
 
-static string getCurrentTimeFilename(string extension) {
-    // Get current time
-    auto now = std::chrono::system_clock::now();
-    auto time_t_now = std::chrono::system_clock::to_time_t(now);
+//Receives a BTCH upload into a new directory named like a received file. Runs as bulk work with the same
+//quantum rules as receiveFile. Frames are checked and handed to the BatchWriter in sequence order. After a
+//frame failed its checksum, frames are dropped until it comes again, up to MAX_RETRANSMIT_ROUNDS tries.
+static Task<bool> receiveBatch(SessionContext& context, SessionStream& stream, uint64_t secret) {
+    string directory = getCurrentTimeFilename("batch");
+    error_code error;
+    //A directory that is already there belongs to someone else, never write into it
+    if (!filesystem::create_directory(directory, error)) {
+        std::cout << "Error creating batch directory " << directory << ": " << error.message() << endl;
+        co_return false;
+    }
+    std::cout << "Receiving batch into: " << directory << endl;
+
+    BatchWriter writer(context.pool, directory, stream.HomeWorker());
+    stream.SetPriority(TaskPriority::Bulk);
+    co_await ScheduleOn{ context.pool, TaskPriority::Bulk, stream.HomeWorker() };
 
-    // Use thread_local to ensure thread safety
-    thread_local std::tm local_tm = {};
+    uint32_t expected = 0;
+    int resendRequests = 0;
+    uint32_t unacknowledged = 0;
+    uint64_t filesWritten = 0;
+    bool completed = false;
+    auto quantumStart = chrono::steady_clock::now();
+    int quantumBytes = 0;
+
+    while (true) {
+        BatchFrameHeader header;
+        if (!co_await stream.recvAll(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            header.payloadBytes > BATCH_FRAME_SIZE) {
+            std::cout << "Encountered error or client disconnected: " << WSAGetLastError() << endl;
+            break;
+        }
+        auto payload = make_shared<vector<char>>(header.payloadBytes);
+        if (!co_await stream.recvAll(payload->data(), header.payloadBytes)) {
+            std::cout << "Encountered error or client disconnected: " << WSAGetLastError() << endl;
+            break;
+        }
+        //Sent before the client saw the request to go back
+        if (header.sequence != expected) {
+            continue;
+        }
+        decrypt(payload->data(), header.payloadBytes, secret);
+        if (crc32c(payload->data(), payload->size()) != header.payloadCrc) {
+            if (++resendRequests > MAX_RETRANSMIT_ROUNDS) {
+                std::cout << "Batch frame " << expected << " keeps failing its checksum" << endl;
+                break;
+            }
+            std::cout << "Requesting batch frames from " << expected << " again" << endl;
+            vector<BatchFileStatus> files = writer.TakeFinished();
+            filesWritten += files.size();
+            if (!co_await sendBatchAck(stream, expected, expected, files, false)) {
+                break;
+            }
+            continue;
+        }
+        resendRequests = 0;
+        expected++;
+        if (header.payloadBytes == 0) {
+            completed = true;
+            break;
+        }
+        if (!writer.Submit(payload)) {
+            std::cout << "Malformed batch frame " << header.sequence << endl;
+            break;
+        }
+        co_await writer.Throttle(BATCH_WRITE_BACKLOG);
 
-    // Use thread-safe localtime if available
-    if (localtime_s(&local_tm, &time_t_now) != 0) {
-        // Fallback or error handling
-        return "default.txt";
+        if (++unacknowledged == BATCH_ACK_FRAMES) {
+            vector<BatchFileStatus> files = writer.TakeFinished();
+            filesWritten += files.size();
+            if (!co_await sendBatchAck(stream, expected, BATCH_NO_RESEND, files, false)) {
+                break;
+            }
+            unacknowledged = 0;
+        }
+
+        quantumBytes += header.payloadBytes;
+        if (quantumBytes >= context.config.bulkQuantumBytes || context.pool.HasInteractivePending() ||
+            chrono::steady_clock::now() - quantumStart >= context.config.latencyTarget) {
+            co_await ScheduleOn{ context.pool, TaskPriority::Bulk, stream.HomeWorker() };
+            quantumStart = chrono::steady_clock::now();
+            quantumBytes = 0;
+        }
+    }
+
+    //Every queued task refers to the writer, so it has to see them all through even when the batch broke off
+    co_await writer.Throttle(0);
+    stream.SetPriority(TaskPriority::Interactive);
+    co_await ScheduleOn{ context.pool, TaskPriority::Interactive, stream.HomeWorker() };
+    if (!completed) {
+        std::cout << "Batch transfer incomplete" << endl;
+        co_return false;
     }
 
-    // Create stringstream and format time
-    std::stringstream ss;
-    ss << std::put_time(&local_tm, "%Y%m%d_%H%M%S");
+    vector<BatchFileStatus> files = writer.TakeFinished();
+    vector<BatchFileStatus> incomplete = writer.TakeIncomplete();
+    files.insert(files.end(), incomplete.begin(), incomplete.end());
+    filesWritten += files.size();
+    std::cout << "Batch of " << filesWritten << " files received in: " << directory << endl;
+    co_return co_await sendBatchAck(stream, expected, BATCH_NO_RESEND, files, true);
+}
 
-    // Append .txt to the end
-    ss << "." << extension;
+//Numbers the shared memory segments so their names are unique within this server process
+static atomic<int> shmSegmentCount{ 0 };
 
-    return ss.str();
+//Segment name prefix with 64 random bits, so no other process can create the objects under it ahead of us
+static string newShmSegmentName() {
+    random_device entropy;
+    uint64_t key = (uint64_t(entropy()) << 32) | entropy();
+    return "Local\\ServerShm-" + to_string(GetCurrentProcessId()) + "-" + to_string(++shmSegmentCount) + "-" +
+        to_string(key);
 }
 
 //Handler
-static void handleClient(SOCKET& acceptSocket) {
+static Task<> handleClient(SessionContext& context, SOCKET acceptSocket, int worker) {
+    AsyncSocket socket(acceptSocket, context.poller, worker);
     //std::cout << "Connection accepted on thread id: " << std::this_thread::get_id() << endl;
     std::cout << "AcceptSocket value: " << acceptSocket << " passed to thread." << std::this_thread::get_id() <<std::endl;
 
     std::cout << "----------STEP-6 => SEND AND RECIEVE DATA TO AND FROM CLIENT ------------" << endl;
     char requestRecvBuffer[8] = { 0 };  // Initialize entire buffer to zeros
-    char* recieveBuffer = new char[MAX_BUFFER];
-    char requestConfirmation[32] = "Recieved request confirmation";
 
-    //Calculation of all keys
-    srand(time(0));
-    uint16_t private_key, primitivRoot, prime, pub_key, pub_key_client;
+    //Key exchange over the RFC 3526 2048-bit group. Both exponentiations run on the handshake stage and the
+    //session hops back to the I/O pool for the socket calls.
     uint64_t secret;
+    unsigned char keyBuffer[DH_BYTES];
 
-    primitivRoot = 26363;
-    private_key = rand() % 65536;
-    prime = generateRandomPrime(0, 65536);
-    pub_key = mod_exp(primitivRoot, private_key, prime);
-
+    co_await ScheduleOn{ context.handshakePool, TaskPriority::Interactive };
+    DhKeyPair keys = dhGenerateKeyPair();
+    dhToBytes(keys.publicKey, keyBuffer);
+    co_await ScheduleOn{ context.pool, TaskPriority::Interactive, worker };
 
-    if (send(acceptSocket, (char*)&prime, sizeof(uint16_t), 0) == SOCKET_ERROR) {
+    if (!co_await socket.send(reinterpret_cast<char*>(keyBuffer), DH_BYTES)) {
         std::cout << "Client send error " << WSAGetLastError() << endl;;
-        return;
+        co_return;
     }
 
-    std::cout << "DEBUG: Sent Client prime successfully " << endl;
+    std::cout << "DEBUG: Sent Client pub_key successfully " << endl;
 
-    if (send(acceptSocket, (char*)&pub_key, sizeof(uint16_t), 0) == SOCKET_ERROR) {
+    if (!co_await socket.recvAll(reinterpret_cast<char*>(keyBuffer), DH_BYTES)) {
         std::cout << "Client send error " << WSAGetLastError() << endl;;
-        return;
+        co_return;
     }
 
-    std::cout << "DEBUG: Sent Client pub_key successfully " << endl;
+    co_await ScheduleOn{ context.handshakePool, TaskPriority::Interactive };
+    DhNumber shared;
+    bool validKey = dhComputeShared(keys.privateKey, dhFromBytes(keyBuffer), shared);
+    co_await ScheduleOn{ context.pool, TaskPriority::Interactive, worker };
 
-    if (recv(acceptSocket, (char *)&pub_key_client, sizeof(uint16_t), 0) == SOCKET_ERROR){
-        std::cout << "Client send error " << WSAGetLastError() << endl;;
-        return;
+    if (!validKey) {
+        std::cout << "Client public key out of range, closing connection" << endl;
+        co_return;
     }
 
-    cout << "KEYS: " << " PRIVATE: " << private_key << " PRIME: " << prime << " CLIENT PUBLIC: " << pub_key_client << endl;
-
     //Calculate secret
-    secret = mod_exp(pub_key_client, private_key, prime);
-   
+    secret = dhSessionKey(shared);
+
     cout << "Secret: " << secret << endl;
+
+    //Requests go over the socket until the client moves the session to shared memory with SHMO
+    SessionStream* stream = &socket;
+    unique_ptr<ShmStream> sharedMemory;
  
     while (true) {
 
         memset(requestRecvBuffer, 0, sizeof(requestRecvBuffer));
-        int requestBytes = recv(acceptSocket, requestRecvBuffer, sizeof(requestRecvBuffer) - 1, 0);
+        int requestBytes = co_await stream->recv(requestRecvBuffer, sizeof(requestRecvBuffer) - 1);
         
 
         if (requestBytes == SOCKET_ERROR || requestBytes == 0) {
@@ -268,7 +1227,7 @@ static void handleClient(SOCKET& acceptSocket) {
 
         std::cout << "DEBUG: Server : Received request (string): '" << requestRecvBuffer << "'" << endl;
 
-        if (send(acceptSocket, "Recieved message confirmation", 32, 0) == SOCKET_ERROR) {
+        if (!co_await stream->send("Recieved message confirmation", 32)) {
             std::cout << "Client send error " << WSAGetLastError() << endl;;
             continue;
         }
@@ -276,22 +1235,26 @@ static void handleClient(SOCKET& acceptSocket) {
 
         if (strncmp(requestRecvBuffer, "CHAT", 4) == 0) {
                 printf("DEBUG: Entering CHAT block...\n");
-                memset(recieveBuffer, 0, sizeof(recieveBuffer));
-                //Overwriting the recieve buffer for new information
-                int byteCount = recv(acceptSocket, recieveBuffer, MAX_BUFFER, 0);
-
-                //decrypt
-                decrypt(recieveBuffer, MAX_BUFFER, secret);
-
-                //Send returns the number of bytes sent to the server
-                if (byteCount == SOCKET_ERROR) {
+                //Messages are length prefixed so only the typed text crosses the wire, not a whole MAX_BUFFER
+                uint32_t messageLength = 0;
+                if (!co_await stream->recvAll(reinterpret_cast<char*>(&messageLength), sizeof(messageLength)) ||
+                    messageLength > MAX_BUFFER) {
+                    std::cout << "Client send error " << WSAGetLastError() << endl;
+                    break;
+                }
+                //Sized to the message instead of keeping a MAX_BUFFER around for every session
+                vector<char> recieveBuffer(messageLength + 1);
+                if (!co_await stream->recvAll(recieveBuffer.data(), messageLength)) {
                     std::cout << "Client send error " << WSAGetLastError() << endl;
                     break;
                 }
 
-                std::cout << "Server: recieved: " << recieveBuffer << " : Client on thread id: " << std::this_thread::get_id() << endl;
+                //decrypt
+                decrypt(recieveBuffer.data(), messageLength, secret);
+
+                std::cout << "Server: recieved: " << recieveBuffer.data() << " : Client on thread id: " << std::this_thread::get_id() << endl;
 
-                if (send(acceptSocket, "Recieved message confirmation", 32, 0) == SOCKET_ERROR) {
+                if (!co_await stream->send("Recieved message confirmation", 32)) {
                     std::cout << "Client send error " << WSAGetLastError() << endl;;
                     break;
                 }
@@ -301,63 +1264,44 @@ static void handleClient(SOCKET& acceptSocket) {
 
         if (strcmp(requestRecvBuffer, "SEND") == 0) {
             printf("DEBUG: Entering SEND block...\n");
-
-            // Receive file size and extension first
-            streampos fileSize;
-            char extension[16];
-
-            int sizeRecv = recv(acceptSocket, reinterpret_cast<char*>(&fileSize), sizeof(fileSize), 0);
-
-            recv(acceptSocket, extension, 16, 0);
-
-            if (sizeRecv != sizeof(fileSize)) {
-                std::cout << "Error receiving file size: " << WSAGetLastError() << endl;
-                continue;
+            if (!co_await receiveFile(context, *stream, secret)) {
+                break;
             }
-            
-            string filename = getCurrentTimeFilename(extension);
-
-            fstream file(filename, ios::binary | ios::out);
-
-            if (!file.is_open()) {
-                std::cout << "Error opening file......." << endl;
-                continue;
+        }
+        //Many files in one request, see BatchProtocol.h
+        if (strcmp(requestRecvBuffer, "BTCH") == 0) {
+            printf("DEBUG: Entering BTCH block...\n");
+            if (!co_await receiveBatch(context, *stream, secret)) {
+                break;
             }
-
-            
-            std::cout << "Receiving file: " << filename << ", Size: " << fileSize << " bytes" << endl;
-            
-            char chunkBuffer[CHUNK_SIZE];
-            streampos totalBytesReceived = 0;
-
-            while (totalBytesReceived < fileSize) {
-                int bytesRemaining = min(static_cast<int>(fileSize - totalBytesReceived), static_cast<int>(sizeof(chunkBuffer)));
-                int bytes = recv(acceptSocket, chunkBuffer, bytesRemaining, 0);
-                decrypt(chunkBuffer, CHUNK_SIZE, secret);
-                if (bytes <= 0) {
-                    std::cout << "Encountered error or client disconnected: " << WSAGetLastError() << endl;
-                    break;
-                }
-
-                file.write(chunkBuffer, bytes);
-                totalBytesReceived += bytes;
-
-                // Optional: Show progress
-                std::cout << "Received " << totalBytesReceived << "/" << fileSize << " bytes" << endl;
+        }
+        //Local clients can move the session to shared memory: they send their process id, the server answers with
+        //the name prefix of the segment it created (empty if it couldn't) and everything after that goes through
+        //the segment's rings while the socket stays open but idle
+        if (strcmp(requestRecvBuffer, "SHMO") == 0 && !sharedMemory) {
+            printf("DEBUG: Entering SHMO block...\n");
+            uint32_t clientProcessId = 0;
+            if (!co_await stream->recvAll(reinterpret_cast<char*>(&clientProcessId), sizeof(clientProcessId))) {
+                std::cout << "Client send error " << WSAGetLastError() << endl;
+                break;
             }
-
-            file.close();
-            if (totalBytesReceived == fileSize) {
-                std::cout << "File received and saved as: " << filename << endl;
-
-                // Send confirmation
-                if (send(acceptSocket, "Received file confirmation", 32, 0) == SOCKET_ERROR) {
-                    std::cout << "Unable to process request " << WSAGetLastError() << endl;
-                }
+            string segmentName = newShmSegmentName();
+            char segmentReply[SHM_NAME_SIZE] = {};
+            auto segment = make_unique<ShmStream>(context.pool, worker);
+            if (segment->Open(segmentName, clientProcessId)) {
+                strncpy_s(segmentReply, SHM_NAME_SIZE, segmentName.c_str(), _TRUNCATE);
             }
             else {
-                std::cout << "File transfer incomplete" << endl;
-                send(acceptSocket, "File transfer failed", 32, 0);
+                std::cout << "Shared memory setup failed " << GetLastError() << endl;
+            }
+            if (!co_await stream->send(segmentReply, SHM_NAME_SIZE)) {
+                std::cout << "Client send error " << WSAGetLastError() << endl;
+                break;
+            }
+            if (segmentReply[0] != '\0') {
+                sharedMemory = move(segment);
+                stream = sharedMemory.get();
+                std::cout << "Session moved to shared memory segment " << segmentName << endl;
             }
         }
         if (strcmp(requestRecvBuffer, "STOP") == 0) {
@@ -368,11 +1312,47 @@ static void handleClient(SOCKET& acceptSocket) {
     }
 
     std::cout << "Server: Closing connection on thread: " << std::this_thread::get_id() << endl;
-    closesocket(acceptSocket);
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    SchedulerConfig schedulerConfig;
+    //Half the cores do key exchanges by default, the I/O pool uses all of them
+    int handshakeThreads = max(1, static_cast<int>(thread::hardware_concurrency()) / 2);
+    //I/O workers float over all processors unless --pin or --cpus places them, see CpuTopology.h
+    WorkerPlacement placement;
+    //Logs every task the pools pick, only for debugging the scheduler
+    bool traceTasks = false;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--latency-target-ms") == 0) {
+            schedulerConfig.latencyTarget = chrono::milliseconds(atoi(argv[i + 1]));
+        }
+        else if (strcmp(argv[i], "--bulk-quantum-kb") == 0) {
+            schedulerConfig.bulkQuantumBytes = atoi(argv[i + 1]) * 1024;
+        }
+        else if (strcmp(argv[i], "--handshake-threads") == 0) {
+            handshakeThreads = max(1, atoi(argv[i + 1]));
+        }
+        else if (strcmp(argv[i], "--pin") == 0) {
+            if (!parsePinMode(argv[i + 1], placement.mode)) {
+                std::cout << "Unknown --pin mode " << argv[i + 1] << ", expected compact, scatter or none" << endl;
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--cpus") == 0) {
+            if (!parseCpuList(argv[i + 1], placement.cpus)) {
+                std::cout << "Bad --cpus list " << argv[i + 1] << ", expected e.g. 0,2,4-7" << endl;
+                return 1;
+            }
+            placement.mode = PinMode::List;
+        }
+        else if (strcmp(argv[i], "--sticky-sessions") == 0) {
+            placement.stickySessions = atoi(argv[i + 1]) != 0;
+        }
+        else if (strcmp(argv[i], "--trace-tasks") == 0) {
+            traceTasks = atoi(argv[i + 1]) != 0;
+        }
+    }
 
     //Step 1 => Initialize WSA
     std::cout << "----------STEP-1 => DLL SETUP------------" << endl;
@@ -440,7 +1420,20 @@ int main()
     vector<thread> clientThreads;
 
     ThreadPool threadPool;
-    threadPool.Start();
+    threadPool.SetTaskTracing(traceTasks);
+    threadPool.Start(0, placement);
+
+    ThreadPool handshakePool;
+    handshakePool.SetTaskTracing(traceTasks);
+    handshakePool.Start(handshakeThreads);
+
+    SessionPoller sessionPoller(threadPool);
+    if (!sessionPoller.Start()) {
+        closesocket(serverSocket);
+        WSACleanup();
+        return -1;
+    }
+    SessionContext sessionContext{ threadPool, handshakePool, sessionPoller, schedulerConfig };
 
     while (true) {
 
@@ -459,11 +1452,10 @@ int main()
         //Why not std::thread(handleClient, acceptSocket)? Emplace gives a shortcut to directly pass the parameters
         
         //clientThreads.push_back(thread(handleClient, acceptSocket));
-        threadPool.QueueTask([acceptSocket]() mutable {
-            handleClient(acceptSocket);
-            // Ensure the socket is closed when the task is done
-            closesocket(acceptSocket);
-            });
+        //The session coroutine owns the socket and closes it when the client is done. With pinned workers the
+        //session stays on the least loaded one for its whole life, so its buffers stay in that core's caches.
+        int worker = threadPool.AcquireWorker();
+        spawn(threadPool, worker, handleClient(sessionContext, acceptSocket, worker));
     }
 
     std::cout << "----------STEP-7 => CLOSE SERVER SOCKET ------------" << endl;
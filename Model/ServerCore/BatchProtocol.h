@@ -0,0 +1,53 @@
+// BatchProtocol.h : Wire format of BTCH, the batch upload of many files or a whole directory in one request.
+// The client streams frames of up to BATCH_FRAME_SIZE bytes, each packing pieces of one or more files, and keeps
+// up to BATCH_WINDOW_FRAMES of them in flight. The server writes the files in parallel and acknowledges frames
+// and finished files in batches. A frame that fails its checksum is asked for again together with every frame
+// sent after it (go-back-N). Header only so the clients can use it without linking ServerCore.
+#pragma once
+
+#include <cstdint>
+
+//Largest payload of one frame
+const uint32_t BATCH_FRAME_SIZE = 64 * 1024;
+//Frames the client sends ahead of the server's acknowledgements
+const uint32_t BATCH_WINDOW_FRAMES = 32;
+//The server acknowledges after this many frames, a quarter of the window keeps the client from stalling
+const uint32_t BATCH_ACK_FRAMES = BATCH_WINDOW_FRAMES / 4;
+//Longest relative path of a file in a batch
+const uint32_t BATCH_MAX_PATH = 1024;
+//resendFrom of an acknowledgement that doesn't ask for anything again
+const uint32_t BATCH_NO_RESEND = 0xFFFFFFFF;
+
+#pragma pack(push, 1)
+//In front of every frame, in the clear. The payload is encrypted and payloadCrc is the CRC32C of its plain
+//bytes. A frame without payload ends the batch.
+struct BatchFrameHeader {
+    uint32_t sequence;
+    uint32_t payloadBytes;
+    uint32_t payloadCrc;
+};
+
+//One piece of a file inside a frame payload, followed by pathBytes of path relative to the batch (only in the
+//piece at offset 0, which always comes first) and then length bytes of file data
+struct BatchRecordHeader {
+    uint32_t fileId;
+    uint16_t pathBytes;
+    uint64_t fileSize;
+    uint64_t offset;
+    uint32_t length;
+};
+
+//Server to client, followed by fileCount BatchFileStatus. Every frame below framesReceived arrived intact.
+//last is set on the final acknowledgement, sent once the end frame arrived and every file is on disk.
+struct BatchAck {
+    uint32_t framesReceived;
+    uint32_t resendFrom;
+    uint32_t fileCount;
+    uint32_t last;
+};
+
+struct BatchFileStatus {
+    uint32_t fileId;
+    uint32_t written;
+};
+#pragma pack(pop)
@@ -0,0 +1,274 @@
+// CpuTopology.h : Logical processors of this machine with their physical core and NUMA node, the orders the
+// thread pool pins its workers in and memory placed on a given node. Windows numbers processors per processor
+// group (at most 64 each), so a processor is a group and a number rather than one index. Include it after
+// winsock2.h.
+#pragma once
+
+#include <windows.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//How the workers of a pool are placed on the processors
+enum class PinMode {
+    //Left to the OS scheduler, every worker may run anywhere
+    None,
+    //Worker after worker on the same node, hyperthreads of a core next to each other
+    Compact,
+    //Spread over the nodes first, then over the cores of each node, hyperthreads last
+    Scatter,
+    //Processors given by the caller, by their index in cpuTopology()
+    List
+};
+
+struct WorkerPlacement {
+    PinMode mode = PinMode::None;
+    //For PinMode::List, worker i gets cpus[i % cpus.size()]
+    std::vector<int> cpus;
+    //Sessions get a home worker and every task of theirs runs there. Only used while the workers are pinned.
+    bool stickySessions = true;
+};
+
+struct LogicalCpu {
+    //Index in system order (group by group), the number --cpus takes
+    int index = 0;
+    WORD group = 0;
+    BYTE number = 0;
+    //Physical core, counted across the whole machine
+    int core = 0;
+    //Hyperthread of its core, 0 for the first one
+    int sibling = 0;
+    int node = 0;
+};
+
+//Every logical processor in system order. Falls back to one node of hardware_concurrency() single threaded
+//cores if the OS doesn't tell.
+inline std::vector<LogicalCpu> cpuTopology() {
+    std::vector<LogicalCpu> cpus;
+    DWORD length = 0;
+    GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+    std::vector<char> records(length);
+    auto* info = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(records.data());
+    if (length == 0 || !GetLogicalProcessorInformationEx(RelationAll, info, &length)) {
+        int count = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 0; i < count; i++) {
+            LogicalCpu cpu;
+            cpu.index = i;
+            cpu.group = static_cast<WORD>(i / 64);
+            cpu.number = static_cast<BYTE>(i % 64);
+            cpu.core = i;
+            cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    //Cores come first in the records, nodes are matched to the processors afterwards by group mask
+    std::vector<std::pair<GROUP_AFFINITY, int>> nodes;
+    int core = 0;
+    for (DWORD offset = 0; offset < length; ) {
+        auto* record = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(records.data() + offset);
+        if (record->Relationship == RelationProcessorCore) {
+            int sibling = 0;
+            for (WORD i = 0; i < record->Processor.GroupCount; i++) {
+                const GROUP_AFFINITY& mask = record->Processor.GroupMask[i];
+                for (BYTE number = 0; number < 64; number++) {
+                    if (mask.Mask & (KAFFINITY(1) << number)) {
+                        LogicalCpu cpu;
+                        cpu.group = mask.Group;
+                        cpu.number = number;
+                        cpu.core = core;
+                        cpu.sibling = sibling++;
+                        cpus.push_back(cpu);
+                    }
+                }
+            }
+            core++;
+        }
+        else if (record->Relationship == RelationNumaNode) {
+            nodes.push_back({ record->NumaNode.GroupMask, static_cast<int>(record->NumaNode.NodeNumber) });
+        }
+        offset += record->Size;
+    }
+
+    std::sort(cpus.begin(), cpus.end(), [](const LogicalCpu& a, const LogicalCpu& b) {
+        return a.group != b.group ? a.group < b.group : a.number < b.number;
+        });
+    for (size_t i = 0; i < cpus.size(); i++) {
+        cpus[i].index = static_cast<int>(i);
+        for (const auto& node : nodes) {
+            if (node.first.Group == cpus[i].group && (node.first.Mask & (KAFFINITY(1) << cpus[i].number))) {
+                cpus[i].node = node.second;
+            }
+        }
+    }
+    return cpus;
+}
+
+//Processor of each of count workers, empty for PinMode::None or when the list names no valid processor
+inline std::vector<LogicalCpu> placeWorkers(const std::vector<LogicalCpu>& topology, const WorkerPlacement& placement,
+    int count) {
+    std::vector<LogicalCpu> order;
+    if (placement.mode == PinMode::List) {
+        for (int index : placement.cpus) {
+            if (index >= 0 && index < static_cast<int>(topology.size())) {
+                order.push_back(topology[index]);
+            }
+        }
+    }
+    else if (placement.mode == PinMode::Compact) {
+        order = topology;
+        std::stable_sort(order.begin(), order.end(), [](const LogicalCpu& a, const LogicalCpu& b) {
+            return a.node != b.node ? a.node < b.node : a.core < b.core;
+            });
+    }
+    else if (placement.mode == PinMode::Scatter) {
+        //Ranks every processor by its sibling number, then by the position of its core within its node, then
+        //by node, so each round takes one core of every node before a node gets its next one
+        std::vector<std::pair<int, int>> coreRanks;
+        std::vector<int> coresPerNode;
+        for (const LogicalCpu& cpu : topology) {
+            if (cpu.sibling == 0) {
+                if (cpu.node >= static_cast<int>(coresPerNode.size())) {
+                    coresPerNode.resize(cpu.node + 1, 0);
+                }
+                coreRanks.push_back({ cpu.core, coresPerNode[cpu.node]++ });
+            }
+        }
+        auto coreRank = [&](int core) {
+            for (const auto& rank : coreRanks) {
+                if (rank.first == core) {
+                    return rank.second;
+                }
+            }
+            return 0;
+        };
+        order = topology;
+        std::stable_sort(order.begin(), order.end(), [&](const LogicalCpu& a, const LogicalCpu& b) {
+            if (a.sibling != b.sibling) {
+                return a.sibling < b.sibling;
+            }
+            int rankA = coreRank(a.core), rankB = coreRank(b.core);
+            return rankA != rankB ? rankA < rankB : a.node < b.node;
+            });
+    }
+
+    std::vector<LogicalCpu> workers;
+    for (int i = 0; i < count && !order.empty(); i++) {
+        workers.push_back(order[i % order.size()]);
+    }
+    return workers;
+}
+
+//Restricts the calling thread to one processor, which also makes the OS place the memory it touches first on
+//that processor's node
+inline bool pinCurrentThread(const LogicalCpu& cpu) {
+    GROUP_AFFINITY affinity = {};
+    affinity.Group = cpu.group;
+    affinity.Mask = KAFFINITY(1) << cpu.number;
+    return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != FALSE;
+}
+
+//Committed memory whose pages come from the given node, or from wherever the OS likes for node -1
+inline void* allocateOnNode(size_t bytes, int node) {
+    if (node >= 0) {
+        if (void* memory = VirtualAllocExNuma(GetCurrentProcess(), nullptr, bytes, MEM_RESERVE | MEM_COMMIT,
+            PAGE_READWRITE, static_cast<DWORD>(node))) {
+            return memory;
+        }
+    }
+    return VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+inline void freeOnNode(void* memory) {
+    if (memory != nullptr) {
+        VirtualFree(memory, 0, MEM_RELEASE);
+    }
+}
+
+//Byte buffer owned like a vector<char> but allocated with allocateOnNode. Without a node it comes from the heap
+//like the vector would, no need for a system call then.
+class NodeBuffer {
+private:
+    char* bytes = nullptr;
+    size_t length = 0;
+    int node = -1;
+
+public:
+    NodeBuffer() = default;
+    NodeBuffer(size_t size, int numaNode) : length(size), node(numaNode) {
+        bytes = node >= 0 ? static_cast<char*>(allocateOnNode(size, node)) : new (std::nothrow) char[size];
+        if (bytes == nullptr) {
+            length = 0;
+        }
+    }
+    NodeBuffer(NodeBuffer&& other) noexcept
+        : bytes(std::exchange(other.bytes, nullptr)), length(std::exchange(other.length, 0)), node(other.node) {}
+    NodeBuffer& operator=(NodeBuffer&& other) noexcept {
+        std::swap(bytes, other.bytes);
+        std::swap(length, other.length);
+        std::swap(node, other.node);
+        return *this;
+    }
+    NodeBuffer(const NodeBuffer&) = delete;
+    NodeBuffer& operator=(const NodeBuffer&) = delete;
+    ~NodeBuffer() {
+        if (node >= 0) {
+            freeOnNode(bytes);
+        }
+        else {
+            delete[] bytes;
+        }
+    }
+
+    char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+//"compact", "scatter" or "none"
+inline bool parsePinMode(const char* text, PinMode& mode) {
+    if (strcmp(text, "none") == 0) mode = PinMode::None;
+    else if (strcmp(text, "compact") == 0) mode = PinMode::Compact;
+    else if (strcmp(text, "scatter") == 0) mode = PinMode::Scatter;
+    else return false;
+    return true;
+}
+
+//Processor indices like "0,2,4-7", false on anything else or on an index this machine doesn't have. The bound
+//also keeps a range like 0-2000000000 from expanding into billions of entries.
+inline bool parseCpuList(const std::string& text, std::vector<int>& cpus) {
+    const long cpuCount = static_cast<long>(cpuTopology().size());
+    cpus.clear();
+    size_t position = 0;
+    while (position < text.size()) {
+        size_t end = text.find(',', position);
+        std::string item = text.substr(position, end == std::string::npos ? std::string::npos : end - position);
+        char* rest;
+        long first = strtol(item.c_str(), &rest, 10);
+        long last = first;
+        if (*rest == '-' && rest != item.c_str() && rest[1] != '\0') {
+            last = strtol(rest + 1, &rest, 10);
+        }
+        if (item.empty() || *rest != '\0' || first < 0 || last < first || last >= cpuCount) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+        position = end == std::string::npos ? text.size() : end + 1;
+    }
+    return !cpus.empty();
+}
+
+inline const char* pinModeName(PinMode mode) {
+    switch (mode) {
+    case PinMode::Compact: return "compact";
+    case PinMode::Scatter: return "scatter";
+    case PinMode::List: return "list";
+    default: return "none";
+    }
+}
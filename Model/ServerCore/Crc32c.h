@@ -0,0 +1,185 @@
+// Crc32c.h : CRC32C (Castagnoli) checksums for file chunks. Uses the SSE4.2 crc32 instruction when the CPU has
+// it, running three independent lanes so the instruction's latency is hidden, and a slicing-by-8 table otherwise.
+// Crc32cCombiner joins the CRCs of consecutive blocks, so per-chunk CRCs add up to the whole-file digest without a
+// second pass over the data. Header only so the clients can use it without linking ServerCore.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CRC32C_HARDWARE 1
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CRC32C_TARGET_SSE42
+#else
+#define CRC32C_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+//Reflected Castagnoli polynomial
+const uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;
+//Bytes of the checksum that follows every chunk of a SEND
+const int CHUNK_CRC_SIZE = sizeof(uint32_t);
+//Bytes per lane of the three-lane hardware loop
+const size_t CRC32C_LANE_BYTES = 256;
+
+struct Crc32cTables {
+    uint32_t table[8][256];
+};
+
+inline const Crc32cTables& crc32cTables() {
+    static const Crc32cTables tables = []() {
+        Crc32cTables result;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0 - (crc & 1)));
+            }
+            result.table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int slice = 1; slice < 8; slice++) {
+                uint32_t previous = result.table[slice - 1][i];
+                result.table[slice][i] = (previous >> 8) ^ result.table[0][previous & 0xFF];
+            }
+        }
+        return result;
+    }();
+    return tables;
+}
+
+//Advances the raw CRC register over length bytes, eight at a time through the sliced tables
+inline uint32_t crc32cUpdateTable(uint32_t crc, const char* data, size_t length) {
+    const Crc32cTables& tables = crc32cTables();
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    while (length >= 8) {
+        uint32_t low, high;
+        memcpy(&low, bytes, 4);
+        memcpy(&high, bytes + 4, 4);
+        low ^= crc;
+        crc = tables.table[7][low & 0xFF] ^ tables.table[6][(low >> 8) & 0xFF] ^
+            tables.table[5][(low >> 16) & 0xFF] ^ tables.table[4][low >> 24] ^
+            tables.table[3][high & 0xFF] ^ tables.table[2][(high >> 8) & 0xFF] ^
+            tables.table[1][(high >> 16) & 0xFF] ^ tables.table[0][high >> 24];
+        bytes += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ tables.table[0][(crc ^ *bytes++) & 0xFF];
+    }
+    return crc;
+}
+
+//Moves a CRC register forward over a fixed number of zero bytes in four table lookups. That's what appending a
+//block to data whose CRC is known does to the register, so Combine(crc(A), crc(B)) = crc(A + B) when B has the
+//length the combiner was built for.
+class Crc32cCombiner {
+private:
+    uint32_t table[4][256];
+
+public:
+    explicit Crc32cCombiner(size_t blockLength) {
+        //The shift is linear, so it's enough to know where each of the 32 register bits ends up
+        uint32_t columns[32];
+        const uint32_t* byteTable = crc32cTables().table[0];
+        for (int bit = 0; bit < 32; bit++) {
+            uint32_t crc = 1u << bit;
+            for (size_t i = 0; i < blockLength; i++) {
+                crc = (crc >> 8) ^ byteTable[crc & 0xFF];
+            }
+            columns[bit] = crc;
+        }
+        for (int slice = 0; slice < 4; slice++) {
+            for (uint32_t value = 0; value < 256; value++) {
+                uint32_t shifted = 0;
+                for (int bit = 0; bit < 8; bit++) {
+                    if (value & (1u << bit)) {
+                        shifted ^= columns[slice * 8 + bit];
+                    }
+                }
+                table[slice][value] = shifted;
+            }
+        }
+    }
+
+    uint32_t Shift(uint32_t crc) const {
+        return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^ table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+    }
+
+    //CRC32C of A followed by B, from the CRC32C of A and of B
+    uint32_t Combine(uint32_t crcBefore, uint32_t blockCrc) const {
+        return Shift(crcBefore) ^ blockCrc;
+    }
+};
+
+#ifdef CRC32C_HARDWARE
+inline bool crc32cHardwareAvailable() {
+    static const bool available = []() {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 20)) != 0;
+#else
+        return __builtin_cpu_supports("sse4.2") != 0;
+#endif
+    }();
+    return available;
+}
+
+CRC32C_TARGET_SSE42 inline uint32_t crc32cHardwareStep(uint32_t crc, const unsigned char* bytes) {
+#if defined(_M_X64) || defined(__x86_64__)
+    uint64_t word;
+    memcpy(&word, bytes, 8);
+    return static_cast<uint32_t>(_mm_crc32_u64(crc, word));
+#else
+    uint32_t low, high;
+    memcpy(&low, bytes, 4);
+    memcpy(&high, bytes + 4, 4);
+    return _mm_crc32_u32(_mm_crc32_u32(crc, low), high);
+#endif
+}
+
+//crc32 has a latency of three cycles but a throughput of one per cycle, so blocks of three lanes are checksummed
+//side by side and the lane registers joined with the combiner afterwards
+CRC32C_TARGET_SSE42 inline uint32_t crc32cUpdateHardware(uint32_t crc, const char* data, size_t length) {
+    static const Crc32cCombiner laneShift(CRC32C_LANE_BYTES);
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    while (length >= 3 * CRC32C_LANE_BYTES) {
+        uint32_t crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < CRC32C_LANE_BYTES; i += 8) {
+            crc = crc32cHardwareStep(crc, bytes + i);
+            crc1 = crc32cHardwareStep(crc1, bytes + CRC32C_LANE_BYTES + i);
+            crc2 = crc32cHardwareStep(crc2, bytes + 2 * CRC32C_LANE_BYTES + i);
+        }
+        crc = laneShift.Shift(laneShift.Shift(crc) ^ crc1) ^ crc2;
+        bytes += 3 * CRC32C_LANE_BYTES;
+        length -= 3 * CRC32C_LANE_BYTES;
+    }
+    while (length >= 8) {
+        crc = crc32cHardwareStep(crc, bytes);
+        bytes += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+    }
+    return crc;
+}
+#endif
+
+//Advances the raw CRC register, on the fastest path this CPU supports
+inline uint32_t crc32cUpdate(uint32_t crc, const char* data, size_t length) {
+#ifdef CRC32C_HARDWARE
+    if (crc32cHardwareAvailable()) {
+        return crc32cUpdateHardware(crc, data, length);
+    }
+#endif
+    return crc32cUpdateTable(crc, data, length);
+}
+
+//CRC32C of a buffer (0 for an empty one), the value checked against "123456789" -> 0xE3069283
+inline uint32_t crc32c(const char* data, size_t length) {
+    return ~crc32cUpdate(~0u, data, length);
+}
@@ -0,0 +1,270 @@
+// DiffieHellman.h : Diffie-Hellman over the 2048-bit MODP group of RFC 3526 (group 14, generator 2) used for the
+// session handshake. Numbers are fixed width, products use Montgomery multiplication and the exponentiation walks
+// a fixed 4 bit window, so the instructions run and the memory touched don't depend on the private exponent.
+// Header only so the clients can use it without linking ServerCore.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+const int DH_BITS = 2048;
+const int DH_LIMBS = DH_BITS / 64;
+//Size of a public key on the wire (big endian)
+const int DH_BYTES = DH_BITS / 8;
+//Private exponents are twice as long as the ~128 bit strength of the group (RFC 3526 section 8)
+const int DH_PRIVATE_BITS = 256;
+//Exponent bits handled per table lookup and multiplication in dhModExp, divides 64
+const int DH_WINDOW_BITS = 4;
+
+//Little endian 64-bit limbs
+struct DhNumber {
+    uint64_t limb[DH_LIMBS];
+};
+
+struct DhKeyPair {
+    DhNumber privateKey;
+    DhNumber publicKey;
+};
+
+//Prime and Montgomery constants, R = 2^2048
+struct DhGroup {
+    DhNumber prime;
+    //R mod p and R^2 mod p, the Montgomery forms of 1 and R
+    DhNumber montgomeryOne;
+    DhNumber rSquared;
+    //-p^-1 mod 2^64
+    uint64_t primeInverse;
+};
+
+//Low half of a * b + c + d, the high half goes to high. The sum always fits in 128 bits.
+inline uint64_t dhMulAdd(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t& high) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    uint64_t low = _umul128(a, b, &high);
+#elif defined(__SIZEOF_INT128__)
+    unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+    uint64_t low = static_cast<uint64_t>(product);
+    high = static_cast<uint64_t>(product >> 64);
+#else
+    uint64_t aLow = a & 0xFFFFFFFF, aHigh = a >> 32, bLow = b & 0xFFFFFFFF, bHigh = b >> 32;
+    uint64_t lowLow = aLow * bLow, lowHigh = aLow * bHigh, highLow = aHigh * bLow;
+    uint64_t middle = (lowLow >> 32) + (lowHigh & 0xFFFFFFFF) + (highLow & 0xFFFFFFFF);
+    uint64_t low = (lowLow & 0xFFFFFFFF) | (middle << 32);
+    high = aHigh * bHigh + (lowHigh >> 32) + (highLow >> 32) + (middle >> 32);
+#endif
+    low += c;
+    high += low < c;
+    low += d;
+    high += low < d;
+    return low;
+}
+
+//result = a - b over all limbs, returns the borrow out
+inline uint64_t dhSubtract(DhNumber& result, const DhNumber& a, const DhNumber& b) {
+    uint64_t borrow = 0;
+    for (int i = 0; i < DH_LIMBS; i++) {
+        uint64_t difference = a.limb[i] - b.limb[i];
+        uint64_t nextBorrow = a.limb[i] < b.limb[i];
+        nextBorrow |= difference < borrow;
+        result.limb[i] = difference - borrow;
+        borrow = nextBorrow;
+    }
+    return borrow;
+}
+
+//Setup only, compares public values
+inline bool dhLess(const DhNumber& a, const DhNumber& b) {
+    for (int i = DH_LIMBS - 1; i >= 0; i--) {
+        if (a.limb[i] != b.limb[i]) {
+            return a.limb[i] < b.limb[i];
+        }
+    }
+    return false;
+}
+
+inline DhNumber dhFromBytes(const unsigned char* bytes) {
+    DhNumber number;
+    for (int i = 0; i < DH_LIMBS; i++) {
+        uint64_t limb = 0;
+        for (int j = 0; j < 8; j++) {
+            limb = (limb << 8) | bytes[DH_BYTES - 8 * (i + 1) + j];
+        }
+        number.limb[i] = limb;
+    }
+    return number;
+}
+
+inline void dhToBytes(const DhNumber& number, unsigned char* bytes) {
+    for (int i = 0; i < DH_LIMBS; i++) {
+        for (int j = 0; j < 8; j++) {
+            bytes[DH_BYTES - 8 * (i + 1) + j] = static_cast<unsigned char>(number.limb[i] >> (56 - 8 * j));
+        }
+    }
+}
+
+inline const DhGroup& dhGroup() {
+    static const DhGroup group = []() {
+        //RFC 3526 section 3: p = 2^2048 - 2^1984 - 1 + 2^64 * { [2^1918 pi] + 124476 }
+        static const unsigned char primeBytes[DH_BYTES] = {
+            0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xC9, 0x0F, 0xDA, 0xA2, 0x21, 0x68, 0xC2, 0x34,
+            0xC4, 0xC6, 0x62, 0x8B, 0x80, 0xDC, 0x1C, 0xD1, 0x29, 0x02, 0x4E, 0x08, 0x8A, 0x67, 0xCC, 0x74,
+            0x02, 0x0B, 0xBE, 0xA6, 0x3B, 0x13, 0x9B, 0x22, 0x51, 0x4A, 0x08, 0x79, 0x8E, 0x34, 0x04, 0xDD,
+            0xEF, 0x95, 0x19, 0xB3, 0xCD, 0x3A, 0x43, 0x1B, 0x30, 0x2B, 0x0A, 0x6D, 0xF2, 0x5F, 0x14, 0x37,
+            0x4F, 0xE1, 0x35, 0x6D, 0x6D, 0x51, 0xC2, 0x45, 0xE4, 0x85, 0xB5, 0x76, 0x62, 0x5E, 0x7E, 0xC6,
+            0xF4, 0x4C, 0x42, 0xE9, 0xA6, 0x37, 0xED, 0x6B, 0x0B, 0xFF, 0x5C, 0xB6, 0xF4, 0x06, 0xB7, 0xED,
+            0xEE, 0x38, 0x6B, 0xFB, 0x5A, 0x89, 0x9F, 0xA5, 0xAE, 0x9F, 0x24, 0x11, 0x7C, 0x4B, 0x1F, 0xE6,
+            0x49, 0x28, 0x66, 0x51, 0xEC, 0xE4, 0x5B, 0x3D, 0xC2, 0x00, 0x7C, 0xB8, 0xA1, 0x63, 0xBF, 0x05,
+            0x98, 0xDA, 0x48, 0x36, 0x1C, 0x55, 0xD3, 0x9A, 0x69, 0x16, 0x3F, 0xA8, 0xFD, 0x24, 0xCF, 0x5F,
+            0x83, 0x65, 0x5D, 0x23, 0xDC, 0xA3, 0xAD, 0x96, 0x1C, 0x62, 0xF3, 0x56, 0x20, 0x85, 0x52, 0xBB,
+            0x9E, 0xD5, 0x29, 0x07, 0x70, 0x96, 0x96, 0x6D, 0x67, 0x0C, 0x35, 0x4E, 0x4A, 0xBC, 0x98, 0x04,
+            0xF1, 0x74, 0x6C, 0x08, 0xCA, 0x18, 0x21, 0x7C, 0x32, 0x90, 0x5E, 0x46, 0x2E, 0x36, 0xCE, 0x3B,
+            0xE3, 0x9E, 0x77, 0x2C, 0x18, 0x0E, 0x86, 0x03, 0x9B, 0x27, 0x83, 0xA2, 0xEC, 0x07, 0xA2, 0x8F,
+            0xB5, 0xC5, 0x5D, 0xF0, 0x6F, 0x4C, 0x52, 0xC9, 0xDE, 0x2B, 0xCB, 0xF6, 0x95, 0x58, 0x17, 0x18,
+            0x39, 0x95, 0x49, 0x7C, 0xEA, 0x95, 0x6A, 0xE5, 0x15, 0xD2, 0x26, 0x18, 0x98, 0xFA, 0x05, 0x10,
+            0x15, 0x72, 0x8E, 0x5A, 0x8A, 0xAC, 0xAA, 0x68, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        };
+        DhGroup group;
+        group.prime = dhFromBytes(primeBytes);
+
+        //Newton iteration for p^-1 mod 2^64, every step doubles the number of correct low bits
+        uint64_t inverse = 1;
+        for (int i = 0; i < 6; i++) {
+            inverse *= 2 - group.prime.limb[0] * inverse;
+        }
+        group.primeInverse = 0 - inverse;
+
+        //p > 2^2047, so R mod p = R - p, which is 0 - p in 2048 bits
+        DhNumber zero = {};
+        dhSubtract(group.montgomeryOne, zero, group.prime);
+
+        //R^2 mod p by doubling R mod p another 2048 times
+        group.rSquared = group.montgomeryOne;
+        for (int i = 0; i < DH_BITS; i++) {
+            uint64_t carry = 0;
+            for (int j = 0; j < DH_LIMBS; j++) {
+                uint64_t limb = group.rSquared.limb[j];
+                group.rSquared.limb[j] = (limb << 1) | carry;
+                carry = limb >> 63;
+            }
+            if (carry || !dhLess(group.rSquared, group.prime)) {
+                dhSubtract(group.rSquared, group.rSquared, group.prime);
+            }
+        }
+        return group;
+    }();
+    return group;
+}
+
+//result = a * b / R mod p for a, b < p (CIOS). No branches or lookups depend on the values; result may alias a or b.
+inline void dhMontgomeryMultiply(DhNumber& result, const DhNumber& a, const DhNumber& b, const DhGroup& group) {
+    uint64_t t[DH_LIMBS + 2] = {};
+    for (int i = 0; i < DH_LIMBS; i++) {
+        uint64_t carry = 0;
+        for (int j = 0; j < DH_LIMBS; j++) {
+            t[j] = dhMulAdd(a.limb[j], b.limb[i], t[j], carry, carry);
+        }
+        t[DH_LIMBS] += carry;
+        t[DH_LIMBS + 1] = t[DH_LIMBS] < carry;
+
+        //Add m * p so the lowest limb becomes zero, then shift everything down one limb
+        uint64_t m = t[0] * group.primeInverse;
+        dhMulAdd(m, group.prime.limb[0], t[0], 0, carry);
+        for (int j = 1; j < DH_LIMBS; j++) {
+            t[j - 1] = dhMulAdd(m, group.prime.limb[j], t[j], carry, carry);
+        }
+        t[DH_LIMBS - 1] = t[DH_LIMBS] + carry;
+        t[DH_LIMBS] = t[DH_LIMBS + 1] + (t[DH_LIMBS - 1] < carry);
+    }
+
+    //t < 2p: keep t - p unless the subtraction borrowed past the extra limb
+    DhNumber low, reduced;
+    memcpy(low.limb, t, sizeof(low.limb));
+    uint64_t borrow = dhSubtract(reduced, low, group.prime);
+    uint64_t keepLow = 0 - static_cast<uint64_t>(t[DH_LIMBS] < borrow);
+    for (int i = 0; i < DH_LIMBS; i++) {
+        result.limb[i] = (low.limb[i] & keepLow) | (reduced.limb[i] & ~keepLow);
+    }
+}
+
+//Copies table[index] by reading every entry, so the memory access pattern doesn't reveal the index
+inline void dhSelect(DhNumber& result, const DhNumber* table, uint64_t index) {
+    memset(&result, 0, sizeof(result));
+    for (uint64_t i = 0; i < (1u << DH_WINDOW_BITS); i++) {
+        uint64_t difference = i ^ index;
+        uint64_t mask = ((difference | (0 - difference)) >> 63) - 1;
+        for (int j = 0; j < DH_LIMBS; j++) {
+            result.limb[j] |= table[i].limb[j] & mask;
+        }
+    }
+}
+
+//base^exponent mod p over the lowest exponentBits bits of exponent (a multiple of DH_WINDOW_BITS), base < p.
+//Every window costs the same squarings, one full table scan and one multiplication, zero windows included.
+inline DhNumber dhModExp(const DhNumber& base, const DhNumber& exponent, int exponentBits) {
+    const DhGroup& group = dhGroup();
+    DhNumber table[1 << DH_WINDOW_BITS];
+    table[0] = group.montgomeryOne;
+    dhMontgomeryMultiply(table[1], base, group.rSquared, group);
+    for (int i = 2; i < (1 << DH_WINDOW_BITS); i++) {
+        dhMontgomeryMultiply(table[i], table[i - 1], table[1], group);
+    }
+
+    DhNumber accumulator = group.montgomeryOne;
+    DhNumber selected;
+    for (int bit = exponentBits - DH_WINDOW_BITS; bit >= 0; bit -= DH_WINDOW_BITS) {
+        for (int i = 0; i < DH_WINDOW_BITS; i++) {
+            dhMontgomeryMultiply(accumulator, accumulator, accumulator, group);
+        }
+        uint64_t window = (exponent.limb[bit / 64] >> (bit % 64)) & ((1u << DH_WINDOW_BITS) - 1);
+        dhSelect(selected, table, window);
+        dhMontgomeryMultiply(accumulator, accumulator, selected, group);
+    }
+
+    //Multiplying by plain 1 leaves the Montgomery form
+    DhNumber one = {};
+    one.limb[0] = 1;
+    dhMontgomeryMultiply(accumulator, accumulator, one, group);
+    return accumulator;
+}
+
+//Fresh private exponent from the system's random source (rand_s with MSVC) and the matching public key 2^x mod p
+inline DhKeyPair dhGenerateKeyPair() {
+    std::random_device entropy;
+    DhKeyPair keys = {};
+    for (int i = 0; i < DH_PRIVATE_BITS / 64; i++) {
+        keys.privateKey.limb[i] = (static_cast<uint64_t>(entropy()) << 32) | entropy();
+    }
+    DhNumber generator = {};
+    generator.limb[0] = 2;
+    keys.publicKey = dhModExp(generator, keys.privateKey, DH_PRIVATE_BITS);
+    return keys;
+}
+
+//Rejects 0, 1, p - 1 and anything >= p (RFC 2631 section 2.1.5 style range check), they'd force a known secret
+inline bool dhIsValidPublicKey(const DhNumber& key) {
+    DhNumber one = {}, primeMinusOne;
+    one.limb[0] = 1;
+    dhSubtract(primeMinusOne, dhGroup().prime, one);
+    return dhLess(one, key) && dhLess(key, primeMinusOne);
+}
+
+//peerPublic^privateKey mod p, false if the peer's key is out of range
+inline bool dhComputeShared(const DhNumber& privateKey, const DhNumber& peerPublic, DhNumber& shared) {
+    if (!dhIsValidPublicKey(peerPublic)) {
+        return false;
+    }
+    shared = dhModExp(peerPublic, privateKey, DH_PRIVATE_BITS);
+    return true;
+}
+
+//Folds the shared value into the 64-bit key the session cipher takes
+inline uint64_t dhSessionKey(const DhNumber& shared) {
+    uint64_t key = 0;
+    for (int i = 0; i < DH_LIMBS; i++) {
+        key = (key ^ shared.limb[i]) * 0x100000001B3ull;
+    }
+    return key;
+}
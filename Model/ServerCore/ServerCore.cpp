@@ -0,0 +1,47 @@
+// ServerCore.cpp : Session cipher and file naming used by the server.
+#include "ServerCore.h"
+#include <iostream>
+#include <ctime>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <atomic>
+
+using namespace std;
+
+void encrypt(char* sendBuffer, int size, uint64_t key) {
+    for (size_t i = 0; i < size; i++) {
+        sendBuffer[i] ^= (key >> (8 * (i % 8))) & 0xFF;
+    }
+}
+
+void decrypt(char* recieveBuffer, int size, uint64_t key) {
+    encrypt(recieveBuffer, size, key); // Same operation reverses the encryption
+}
+
+//Numbers the names handed out by this process, the timestamp alone repeats within a second
+static atomic<uint64_t> filenameCount{ 0 };
+
+string getCurrentTimeFilename(string extension) {
+    // Get current time
+    auto now = std::chrono::system_clock::now();
+    auto time_t_now = std::chrono::system_clock::to_time_t(now);
+
+    // Use thread_local to ensure thread safety
+    thread_local std::tm local_tm = {};
+
+    // Use thread-safe localtime if available
+    if (localtime_s(&local_tm, &time_t_now) != 0) {
+        // Fallback or error handling
+        return "default.txt";
+    }
+
+    // Create stringstream and format time
+    std::stringstream ss;
+    ss << std::put_time(&local_tm, "%Y%m%d_%H%M%S") << "_" << filenameCount++;
+
+    // Append .txt to the end
+    ss << "." << extension;
+
+    return ss.str();
+}
@@ -0,0 +1,13 @@
+// ServerCore.h : Session cipher and file naming used by the server. Built as a static library so the
+// benchmarks can link the same code. The key exchange lives in DiffieHellman.h.
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+//XOR stream keyed by the session secret, applied per buffer starting at key byte 0
+void encrypt(char* sendBuffer, int size, uint64_t key);
+void decrypt(char* recieveBuffer, int size, uint64_t key);
+
+//Timestamp based name (YYYYMMDD_HHMMSS_N.extension) for received files, N counts the names this process gave out
+std::string getCurrentTimeFilename(std::string extension);
@@ -0,0 +1,282 @@
+// ShmRing.h : Shared memory transport for clients on the same machine as the server. A session maps one pagefile
+// backed section holding two single producer / single consumer byte rings, one per direction, and uses named
+// auto-reset events to wake a side only when it actually went to sleep on an empty or full ring.
+// Header only so the clients can use it without linking ServerCore. Include it after winsock2.h.
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <new>
+#include <thread>
+
+//Bytes per direction, must be a power of two
+const uint32_t SHM_RING_CAPACITY = 1024 * 1024;
+//Size of the name prefix the server sends back for a SHMO request
+const int SHM_NAME_SIZE = 64;
+//Polls of an empty or full ring before the blocking helpers go to sleep on the event
+const int SHM_SPIN_COUNT = 4000;
+//Longest sleep of the blocking helpers on an event before they check the peer is still there
+const DWORD SHM_PEER_CHECK_MS = 200;
+
+//Spinning only helps when the peer runs on another CPU at the same time
+inline int shmSpinCount() {
+    static const int spinCount = std::thread::hardware_concurrency() > 1 ? SHM_SPIN_COUNT : 0;
+    return spinCount;
+}
+
+//Control block in front of every ring. head and tail count the bytes ever written and read (wrapping at 2^32)
+//and sit on their own cache lines because they are written from different processes.
+struct ShmRingControl {
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+    //Set by a side right before it sleeps on its event, cleared by the side that wakes it up
+    alignas(64) std::atomic<uint32_t> consumerWaiting;
+    std::atomic<uint32_t> producerWaiting;
+    std::atomic<uint32_t> closed;
+};
+
+//View of one direction. Exactly one thread (or coroutine) writes and one reads at any time.
+class ShmRing {
+private:
+    ShmRingControl* control = nullptr;
+    char* data = nullptr;
+    //Signalled when bytes were published while the consumer slept
+    HANDLE dataEvent = nullptr;
+    //Signalled when space was freed while the producer slept
+    HANDLE spaceEvent = nullptr;
+
+public:
+    ShmRing() = default;
+    ShmRing(ShmRingControl* ringControl, char* ringData, HANDLE dataReady, HANDLE spaceReady)
+        : control(ringControl), data(ringData), dataEvent(dataReady), spaceEvent(spaceReady) {}
+
+    HANDLE DataEvent() const { return dataEvent; }
+    HANDLE SpaceEvent() const { return spaceEvent; }
+
+    //Copies up to length bytes in. Returns the number copied, 0 when the ring is full or -1 once it's closed.
+    int TryWrite(const char* buffer, int length) {
+        if (control->closed.load()) {
+            return -1;
+        }
+        uint32_t head = control->head.load(std::memory_order_relaxed);
+        uint32_t tail = control->tail.load(std::memory_order_acquire);
+        //tail comes from the other process, one that claims more bytes than the ring holds ends the stream
+        if (head - tail > SHM_RING_CAPACITY) {
+            return -1;
+        }
+        uint32_t count = std::min<uint32_t>(length, SHM_RING_CAPACITY - (head - tail));
+        if (count == 0) {
+            return 0;
+        }
+        uint32_t offset = head & (SHM_RING_CAPACITY - 1);
+        uint32_t first = (std::min)(count, SHM_RING_CAPACITY - offset);
+        memcpy(data + offset, buffer, first);
+        memcpy(data, buffer + first, count - first);
+        //Sequentially consistent so it can't pass the consumer's consumerWaiting store in PrepareWaitForData
+        control->head.store(head + count);
+        if (control->consumerWaiting.load() && control->consumerWaiting.exchange(0)) {
+            SetEvent(dataEvent);
+        }
+        return count;
+    }
+
+    //Copies up to length bytes out. Returns the number copied, 0 when the ring is empty or -1 once it's closed
+    //and drained.
+    int TryRead(char* buffer, int length) {
+        //closed is read first so a close seen here also makes every byte written before it visible
+        bool isClosed = control->closed.load();
+        uint32_t tail = control->tail.load(std::memory_order_relaxed);
+        uint32_t head = control->head.load();
+        //Same for a head from the other process
+        if (head - tail > SHM_RING_CAPACITY) {
+            return -1;
+        }
+        uint32_t count = std::min<uint32_t>(length, head - tail);
+        if (count == 0) {
+            return isClosed ? -1 : 0;
+        }
+        uint32_t offset = tail & (SHM_RING_CAPACITY - 1);
+        uint32_t first = (std::min)(count, SHM_RING_CAPACITY - offset);
+        memcpy(buffer, data + offset, first);
+        memcpy(buffer + first, data, count - first);
+        control->tail.store(tail + count);
+        if (control->producerWaiting.load() && control->producerWaiting.exchange(0)) {
+            SetEvent(spaceEvent);
+        }
+        return count;
+    }
+
+    //Announces that the consumer is about to sleep on DataEvent. Returns false if data arrived or the ring closed
+    //in the meantime, the caller must not sleep then.
+    bool PrepareWaitForData() {
+        control->consumerWaiting.store(1);
+        if (control->head.load() != control->tail.load(std::memory_order_relaxed) || control->closed.load()) {
+            control->consumerWaiting.store(0);
+            return false;
+        }
+        return true;
+    }
+
+    //Same for a producer about to sleep on SpaceEvent. Only a ring that is exactly full is slept on, TryWrite
+    //reports anything past full as closed.
+    bool PrepareWaitForSpace() {
+        control->producerWaiting.store(1);
+        if (control->head.load(std::memory_order_relaxed) - control->tail.load() != SHM_RING_CAPACITY ||
+            control->closed.load()) {
+            control->producerWaiting.store(0);
+            return false;
+        }
+        return true;
+    }
+
+    //Ends this direction: writes fail, reads fail once the ring is drained and both sides are woken up
+    void Close() {
+        control->closed.store(1);
+        SetEvent(dataEvent);
+        SetEvent(spaceEvent);
+    }
+
+    //Blocking variants for clients that drive a session from their own thread. They spin for a moment before
+    //sleeping so a quick answer from the server doesn't cost a wakeup on either side. A peer that died can't
+    //close the ring, so every SHM_PEER_CHECK_MS asleep peerAlive is asked and false from it fails the call.
+    bool WriteAll(const char* buffer, int length, const std::function<bool()>& peerAlive = nullptr) {
+        int spins = 0;
+        while (length > 0) {
+            int written = TryWrite(buffer, length);
+            if (written < 0) {
+                return false;
+            }
+            if (written > 0) {
+                buffer += written;
+                length -= written;
+                spins = 0;
+            }
+            else if (++spins < shmSpinCount()) {
+                YieldProcessor();
+            }
+            else if (PrepareWaitForSpace() && WaitForSingleObject(spaceEvent, SHM_PEER_CHECK_MS) == WAIT_TIMEOUT &&
+                peerAlive && !peerAlive()) {
+                Close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ReadAll(char* buffer, int length, const std::function<bool()>& peerAlive = nullptr) {
+        int spins = 0;
+        while (length > 0) {
+            int bytes = TryRead(buffer, length);
+            if (bytes < 0) {
+                return false;
+            }
+            if (bytes > 0) {
+                buffer += bytes;
+                length -= bytes;
+                spins = 0;
+            }
+            else if (++spins < shmSpinCount()) {
+                YieldProcessor();
+            }
+            else if (PrepareWaitForData() && WaitForSingleObject(dataEvent, SHM_PEER_CHECK_MS) == WAIT_TIMEOUT &&
+                peerAlive && !peerAlive()) {
+                Close();
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+//Mapping, events and both rings of one session. The server creates the named objects and sends their common
+//prefix to the client, which opens them by that name. Create fails if any of the objects already exists: another
+//process could have made it first to read or feed the session, so the prefix should not be guessable either.
+class ShmSegment {
+private:
+    static const size_t RING_BYTES = sizeof(ShmRingControl) + SHM_RING_CAPACITY;
+
+    HANDLE mapping = nullptr;
+    char* view = nullptr;
+    //Data and space events of the client to server ring, then of the server to client ring
+    HANDLE events[4] = {};
+    ShmRing toServer;
+    ShmRing toClient;
+
+    bool Attach(const std::string& prefix, bool create) {
+        if (create) {
+            mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+                static_cast<DWORD>(2 * RING_BYTES), (prefix + "-map").c_str());
+            if (mapping != nullptr && GetLastError() == ERROR_ALREADY_EXISTS) {
+                CloseHandle(mapping);
+                mapping = nullptr;
+            }
+        }
+        else {
+            mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, (prefix + "-map").c_str());
+        }
+        if (mapping == nullptr) {
+            return false;
+        }
+        view = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 2 * RING_BYTES));
+        if (view == nullptr) {
+            return false;
+        }
+
+        for (int i = 0; i < 4; i++) {
+            std::string name = prefix + "-event" + std::to_string(i);
+            events[i] = create ? CreateEventA(NULL, FALSE, FALSE, name.c_str())
+                : OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, name.c_str());
+            if (events[i] != nullptr && create && GetLastError() == ERROR_ALREADY_EXISTS) {
+                CloseHandle(events[i]);
+                events[i] = nullptr;
+            }
+            if (events[i] == nullptr) {
+                return false;
+            }
+        }
+
+        ShmRingControl* controls[2];
+        for (int i = 0; i < 2; i++) {
+            char* ring = view + i * RING_BYTES;
+            controls[i] = create ? new (ring) ShmRingControl() : reinterpret_cast<ShmRingControl*>(ring);
+        }
+        toServer = ShmRing(controls[0], view + sizeof(ShmRingControl), events[0], events[1]);
+        toClient = ShmRing(controls[1], view + RING_BYTES + sizeof(ShmRingControl), events[2], events[3]);
+        return true;
+    }
+
+public:
+    ShmSegment() = default;
+    ShmSegment(const ShmSegment&) = delete;
+    ShmSegment& operator=(const ShmSegment&) = delete;
+
+    //Closes both directions so the peer sees the end of the session, then releases the handles
+    ~ShmSegment() {
+        if (view != nullptr && events[3] != nullptr) {
+            toServer.Close();
+            toClient.Close();
+        }
+        for (HANDLE event : events) {
+            if (event != nullptr) {
+                CloseHandle(event);
+            }
+        }
+        if (view != nullptr) {
+            UnmapViewOfFile(view);
+        }
+        if (mapping != nullptr) {
+            CloseHandle(mapping);
+        }
+    }
+
+    bool Create(const std::string& prefix) { return Attach(prefix, true); }
+    bool Open(const std::string& prefix) { return Attach(prefix, false); }
+
+    ShmRing& ToServer() { return toServer; }
+    ShmRing& ToClient() { return toClient; }
+};
@@ -0,0 +1,486 @@
+// ThreadPool.h : Worker pool with an interactive and a bulk task queue, used by the server. Workers can be pinned
+// to processors (see CpuTopology.h), each one then keeps its own queues on its NUMA node and a session can be
+// bound to one worker for its whole life. Include it after winsock2.h.
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <functional>
+#include <future>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <utility>
+#include "CpuTopology.h"
+
+using namespace std;
+
+//Scheduling classes of the pool. Interactive work (handshakes, command replies, CHAT) is always picked before
+//Bulk work (file upload quanta) so a few large uploads can't starve the chat traffic of other clients
+enum class TaskPriority {
+    Interactive,
+    Bulk
+};
+
+//FIFO of tasks whose slots live on one NUMA node. Starts with one allocation granule worth of slots and doubles,
+//moving the waiting tasks into a new block on the same node.
+class NodeTaskQueue {
+private:
+    static const size_t INITIAL_BYTES = 64 * 1024;
+
+    int node;
+    NodeBuffer storage;
+    function<void()>* slots = nullptr;
+    size_t capacity = 0;
+    size_t head = 0;
+    size_t count = 0;
+
+    void Grow() {
+        size_t newCapacity = capacity == 0 ? INITIAL_BYTES / sizeof(function<void()>) : capacity * 2;
+        NodeBuffer newStorage(newCapacity * sizeof(function<void()>), node);
+        if (newStorage.data() == nullptr) {
+            throw bad_alloc();
+        }
+        function<void()>* newSlots = reinterpret_cast<function<void()>*>(newStorage.data());
+        for (size_t i = 0; i < count; i++) {
+            function<void()>& task = slots[(head + i) % capacity];
+            new (&newSlots[i]) function<void()>(move(task));
+            task.~function();
+        }
+        storage = move(newStorage);
+        slots = newSlots;
+        capacity = newCapacity;
+        head = 0;
+    }
+
+public:
+    explicit NodeTaskQueue(int numaNode) : node(numaNode) {}
+    NodeTaskQueue(const NodeTaskQueue&) = delete;
+    NodeTaskQueue& operator=(const NodeTaskQueue&) = delete;
+    ~NodeTaskQueue() {
+        while (count > 0) {
+            Pop();
+        }
+    }
+
+    bool Empty() const { return count == 0; }
+
+    void Push(function<void()> task) {
+        if (count == capacity) {
+            Grow();
+        }
+        new (&slots[(head + count) % capacity]) function<void()>(move(task));
+        count++;
+    }
+
+    function<void()> Pop() {
+        function<void()> task = move(slots[head]);
+        slots[head].~function();
+        head = (head + 1) % capacity;
+        count--;
+        return task;
+    }
+};
+
+class ThreadPool {
+public:
+    //Post() target of a task any worker may run
+    static const int ANY_WORKER = -1;
+
+private:
+    /*State of one worker. It is created by the worker thread itself once it is pinned, in memory of its own
+    node, so the queues it reads on every task are local. Tasks posted to this worker wait in its queues, tasks
+    for any worker in the shared queues of the pool.*/
+    struct Worker {
+        ThreadPool* pool;
+        int index;
+        //Processor the worker is pinned to, cpu.node is -1 for an unpinned worker
+        LogicalCpu cpu;
+        mutex worker_mutex;
+        condition_variable wakeup;
+        NodeTaskQueue interactive_tasks;
+        NodeTaskQueue bulk_tasks;
+        //Tasks in the two queues above, read without the lock to skip them when they are empty
+        atomic<size_t> queued{ 0 };
+        atomic<size_t> pending_interactive{ 0 };
+        //Set when a shared task was handed to this worker while it slept, or when the pool shuts down
+        bool signaled = false;
+        //Only touched by the worker thread
+        int interactive_streak = 0;
+        //Sessions bound to this worker, AcquireWorker() picks the worker with the fewest
+        atomic<int> sessions{ 0 };
+
+        Worker(ThreadPool* owner, int workerIndex, const LogicalCpu& processor)
+            : pool(owner), index(workerIndex), cpu(processor), interactive_tasks(processor.node), bulk_tasks(processor.node) {}
+    };
+
+    vector<thread> threads;
+    vector<Worker*> workers;
+    WorkerPlacement placement;
+    bool pinned = false;
+    queue<function<void()>> interactive_tasks;
+    queue<function<void()>> bulk_tasks;
+    mutex task_mutex;
+    condition_variable mutex_condition;
+    atomic<bool> should_terminate{ false };
+    //Tasks in the shared queues, read without the lock like the worker's own counters
+    atomic<size_t> queued{ 0 };
+    //Read without the lock by running bulk quanta to find out if they should yield early
+    atomic<size_t> pending_interactive{ 0 };
+    //Workers sleeping until a task shows up, the last one to go to sleep is woken first as its cache is warmest
+    vector<Worker*> idle_workers;
+    static const int MAX_INTERACTIVE_STREAK = 8;
+    bool trace_tasks = false;
+    //Keeps the trace lines whole, separate from task_mutex so tracing never holds up posting or picking tasks
+    mutex trace_mutex;
+
+    //Worker running on this thread, null on threads that aren't pool workers
+    static inline thread_local Worker* current_worker = nullptr;
+
+    //The task counters only change under their queue's mutex, so a plain store is enough for the readers that
+    //peek at them without the lock
+    static void AddCount(atomic<size_t>& counter, int delta) {
+        counter.store(counter.load(memory_order_relaxed) + delta, memory_order_relaxed);
+    }
+
+    void Enqueue(TaskPriority priority, function<void()> task) {
+        Worker* idle = nullptr;
+        {
+            unique_lock<std::mutex> lock(task_mutex);
+            if (priority == TaskPriority::Interactive) {
+                interactive_tasks.push(move(task));
+                AddCount(pending_interactive, 1);
+            }
+            else {
+                bulk_tasks.push(move(task));
+            }
+            AddCount(queued, 1);
+            if (!idle_workers.empty()) {
+                idle = idle_workers.back();
+                idle_workers.pop_back();
+            }
+        }
+        //Every other worker is busy and looks at the shared queues before it goes to sleep again
+        if (idle != nullptr) {
+            {
+                unique_lock<std::mutex> lock(idle->worker_mutex);
+                idle->signaled = true;
+            }
+            idle->wakeup.notify_one();
+        }
+    }
+
+    void EnqueueOn(Worker& worker, TaskPriority priority, function<void()> task) {
+        {
+            unique_lock<std::mutex> lock(worker.worker_mutex);
+            if (priority == TaskPriority::Interactive) {
+                worker.interactive_tasks.Push(move(task));
+                AddCount(worker.pending_interactive, 1);
+            }
+            else {
+                worker.bulk_tasks.Push(move(task));
+            }
+            AddCount(worker.queued, 1);
+        }
+        worker.wakeup.notify_one();
+    }
+
+    //Takes a task of the given class from the worker's own queue or else from the shared one
+    bool TakeTask(Worker& worker, TaskPriority priority, function<void()>& task) {
+        bool interactive = priority == TaskPriority::Interactive;
+        if (worker.queued.load(memory_order_relaxed) > 0) {
+            unique_lock<std::mutex> lock(worker.worker_mutex);
+            NodeTaskQueue& local = interactive ? worker.interactive_tasks : worker.bulk_tasks;
+            if (!local.Empty()) {
+                task = local.Pop();
+                AddCount(worker.queued, -1);
+                if (interactive) {
+                    AddCount(worker.pending_interactive, -1);
+                }
+                return true;
+            }
+        }
+        if (queued.load(memory_order_relaxed) > 0) {
+            unique_lock<std::mutex> lock(task_mutex);
+            queue<function<void()>>& shared = interactive ? interactive_tasks : bulk_tasks;
+            if (!shared.empty()) {
+                task = move(shared.front());
+                shared.pop();
+                AddCount(queued, -1);
+                if (interactive) {
+                    AddCount(pending_interactive, -1);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //Interactive tasks win unless they have been picked MAX_INTERACTIVE_STREAK times in a row while bulk work
+    //was waiting, so uploads still make progress. False if there is nothing to do.
+    bool PickTask(Worker& worker, function<void()>& task) {
+        bool bulkFirst = worker.interactive_streak >= MAX_INTERACTIVE_STREAK;
+        if (!bulkFirst && TakeTask(worker, TaskPriority::Interactive, task)) {
+            worker.interactive_streak++;
+            return true;
+        }
+        if (TakeTask(worker, TaskPriority::Bulk, task)) {
+            worker.interactive_streak = 0;
+            return true;
+        }
+        if (TakeTask(worker, TaskPriority::Interactive, task)) {
+            worker.interactive_streak++;
+            return true;
+        }
+        return false;
+    }
+
+    //Sleeps until a task is posted to this worker or a shared task is handed to it. The worker registers as
+    //idle before it sleeps and checks the shared queues under the same lock, so no shared task can slip past it.
+    //False once the pool shuts down.
+    bool WaitForTask(Worker& worker) {
+        //A shared task handed over while the worker was still awake, look for it before sleeping
+        {
+            unique_lock<std::mutex> lock(worker.worker_mutex);
+            if (exchange(worker.signaled, false)) {
+                return !should_terminate;
+            }
+        }
+        {
+            unique_lock<std::mutex> lock(task_mutex);
+            if (should_terminate) {
+                return false;
+            }
+            if (!interactive_tasks.empty() || !bulk_tasks.empty()) {
+                return true;
+            }
+            idle_workers.push_back(&worker);
+        }
+        bool handedTask;
+        {
+            unique_lock<std::mutex> lock(worker.worker_mutex);
+            worker.wakeup.wait(lock, [&worker] {
+                return worker.signaled || !worker.interactive_tasks.Empty() || !worker.bulk_tasks.Empty();
+                });
+            handedTask = exchange(worker.signaled, false);
+        }
+        //Whoever handed over a shared task already took the worker off the idle list
+        if (!handedTask) {
+            unique_lock<std::mutex> lock(task_mutex);
+            idle_workers.erase(remove(idle_workers.begin(), idle_workers.end(), &worker), idle_workers.end());
+        }
+        return !should_terminate;
+    }
+
+    //Pins the calling thread if the pool is pinned and builds its Worker on the thread's node
+    Worker* CreateWorker(int index, LogicalCpu cpu) {
+        if (!pinned || !pinCurrentThread(cpu)) {
+            cpu.node = -1;
+        }
+        void* memory = allocateOnNode(sizeof(Worker), cpu.node);
+        if (memory == nullptr) {
+            throw bad_alloc();
+        }
+        return new (memory) Worker(this, index, cpu);
+    }
+
+public:
+    //Logs every task pick, off by default as the console then becomes the bottleneck of the pool
+    void SetTaskTracing(bool enabled) {
+        trace_tasks = enabled;
+    }
+
+    //Intializing with the max number of threads supported by the hardware unless a count is given (or as many
+    //as processors listed for PinMode::List). Returns once every worker is pinned and ready.
+    void Start(int num_threads = 0, WorkerPlacement workerPlacement = {}) {
+        placement = workerPlacement;
+        if (num_threads <= 0) {
+            num_threads = placement.mode == PinMode::List && !placement.cpus.empty()
+                ? static_cast<int>(placement.cpus.size()) : static_cast<int>(thread::hardware_concurrency());
+        }
+        vector<LogicalCpu> cpus = placeWorkers(cpuTopology(), placement, num_threads);
+        pinned = !cpus.empty();
+        if (placement.mode != PinMode::None && !pinned) {
+            std::cout << "No processor to pin the workers to, running them unpinned" << std::endl;
+        }
+        cpus.resize(num_threads);
+
+        workers.assign(num_threads, nullptr);
+        for (int i = 0; i < num_threads; i++) {
+            //Why Not Just the Function Name? A member function is not a standalone function, it is bound to an 
+            // instance of its class. ThreadLoop on its own doesnt know which instance of the class it should operate on.
+            threads.emplace_back(thread(&ThreadPool::ThreadLoop, this, i, cpus[i]));
+        }
+        {
+            unique_lock<std::mutex> lock(task_mutex);
+            mutex_condition.wait(lock, [this] {
+                return all_of(workers.begin(), workers.end(), [](Worker* worker) { return worker != nullptr; });
+                });
+        }
+        std::cout << "Thread pool started with " << threads.size() << " threads." << std::endl;
+        for (Worker* worker : workers) {
+            if (worker->cpu.node >= 0) {
+                std::cout << "Worker " << worker->index << " pinned to CPU " << worker->cpu.index << " (group "
+                    << worker->cpu.group << ", core " << worker->cpu.core << ", node " << worker->cpu.node << ")" << std::endl;
+            }
+        }
+    }
+
+    void ThreadLoop(int index, LogicalCpu cpu) {
+        Worker* worker = CreateWorker(index, cpu);
+        current_worker = worker;
+        {
+            unique_lock<std::mutex> lock(task_mutex);
+            workers[index] = worker;
+        }
+        mutex_condition.notify_all();
+
+        //while loop so that the thread is continously active
+        while (!should_terminate) {
+            function<void()> task;
+            if (!PickTask(*worker, task)) {
+                //No task anywhere: the thread goes to sleep until one is posted to it or handed to it
+                if (!WaitForTask(*worker)) {
+                    return;
+                }
+                continue;
+            }
+            if (trace_tasks) {
+                lock_guard<std::mutex> lock(trace_mutex);
+                std::cout << "Task picked by thread: " << this_thread::get_id() << endl;
+            }
+            task();
+
+        }
+    }
+
+    /*Templates allow the QueueTask method to accept any callable object(e.g., functions, lambdas, or functors)
+    with any number of parameters and any return type.
+    1) F is the callable function type (e.g., a lambda or function pointer).
+    2) Args... represents the parameter types for the callable.
+    3) decltype(func(args...)) deduces the return type of the callable.
+    The thread pool queues tasks to be executed asynchronously, Without std::future, you'd have to block the main
+    thread until the task completes, defeating the purpose of asynchronous execution.
+    The && in F&& func and Args&&... args represents perfect forwarding,
+    Perfect forwarding ensures that:
+    1)If you pass an lvalue(e.g., a variable), it is passed as value to the callable.
+    2)If you pass an rvalue(e.g., a temporary object), it is passed as reference to the callable.*/
+    template<typename  F, typename ... Args>
+    auto QueueTask(F&& func, Args&&... args) -> future<decltype(func(args...))> {
+        return QueueTaskWithPriority(TaskPriority::Interactive, forward<F>(func), forward<Args>(args)...);
+    }
+
+    //Same as QueueTask but the task only runs when no interactive work is waiting
+    template<typename  F, typename ... Args>
+    auto QueueBulkTask(F&& func, Args&&... args) -> future<decltype(func(args...))> {
+        return QueueTaskWithPriority(TaskPriority::Bulk, forward<F>(func), forward<Args>(args)...);
+    }
+
+    template<typename  F, typename ... Args>
+    auto QueueTaskWithPriority(TaskPriority priority, F&& func, Args&&... args) -> future<decltype(func(args...))> {
+
+        using return_type = decltype(func(args...));
+
+        /*is used to wrap the callable object. This lets us execute the function later while associating its
+        result with a std::future. It gives us a shared pointer "task". The function and its arguments are
+        bound together using std::bind*/
+
+        auto task = make_shared<packaged_task<return_type()>>(bind(forward<F>(func), forward<Args>(args)...));
+
+        future<return_type> result = task->get_future();
+
+        /*[task]() { (*task)(); } is a lambda function that :
+        1) Captures the task shared pointer by value([task]).
+        2) Dereferences the task pointer and invokes the callable((*task)()).
+        Why is this necessary? The queue stores generic tasks as std::function<void()>. To convert the
+        actual task (which might take arguments and return values) into this format, we wrap it inside a
+        lambda.*/
+        Enqueue(priority, [task]() { (*task)(); });
+        return result;
+    }
+
+    //Queues a plain callback without the packaged_task/future of QueueTask, used to resume coroutines. A task
+    //for one worker (see AcquireWorker) only ever runs on that worker.
+    void Post(TaskPriority priority, function<void()> task, int worker = ANY_WORKER) {
+        if (worker >= 0 && worker < static_cast<int>(workers.size())) {
+            EnqueueOn(*workers[worker], priority, move(task));
+        }
+        else {
+            Enqueue(priority, move(task));
+        }
+    }
+
+    //Home worker for a new session, the pinned worker with the fewest sessions. ANY_WORKER if the workers aren't
+    //pinned or sessions shouldn't stick to them, the session's tasks then go to the shared queues.
+    int AcquireWorker() {
+        if (!pinned || !placement.stickySessions || workers.empty()) {
+            return ANY_WORKER;
+        }
+        Worker* least = workers[0];
+        for (Worker* worker : workers) {
+            if (worker->sessions.load(memory_order_relaxed) < least->sessions.load(memory_order_relaxed)) {
+                least = worker;
+            }
+        }
+        least->sessions++;
+        return least->index;
+    }
+
+    //Called when the session that got the worker from AcquireWorker ends
+    void ReleaseWorker(int worker) {
+        if (worker >= 0 && worker < static_cast<int>(workers.size())) {
+            workers[worker]->sessions--;
+        }
+    }
+
+    //NUMA node of the worker calling it, -1 on other threads or unpinned workers. Sessions allocate their
+    //buffers there with NodeBuffer.
+    int CurrentNode() const {
+        Worker* worker = current_worker;
+        return worker != nullptr && worker->pool == this ? worker->cpu.node : -1;
+    }
+
+    //Interactive work the calling worker could run next, in the shared queues or in its own
+    bool HasInteractivePending() const {
+        if (pending_interactive.load(memory_order_relaxed) > 0) {
+            return true;
+        }
+        Worker* worker = current_worker;
+        return worker != nullptr && worker->pool == this && worker->pending_interactive.load(memory_order_relaxed) > 0;
+    }
+
+    ~ThreadPool() {
+        {
+            unique_lock<std::mutex> lock(task_mutex);
+            should_terminate = true;
+        }
+        //notifying all the sleeping threads that should_terminate it true quickly finish your job and come out of
+        //your while loops
+        for (Worker* worker : workers) {
+            if (worker != nullptr) {
+                {
+                    unique_lock<std::mutex> lock(worker->worker_mutex);
+                    worker->signaled = true;
+                }
+                worker->wakeup.notify_one();
+            }
+        }
+        //Blocking the main thread till each thread is done and dusted with it's work
+        for (thread& active_thread : threads) {
+            active_thread.join();
+        }
+        threads.clear();
+        for (Worker* worker : workers) {
+            if (worker != nullptr) {
+                worker->~Worker();
+                freeOnNode(worker);
+            }
+        }
+        workers.clear();
+    }
+};
@@ -0,0 +1,208 @@
+// TransportBench.cpp : Runs the same CHAT and SEND traffic over loopback TCP and over the shared memory transport
+// (SHMO) and compares round trip latency, messages/sec and upload throughput. Start the server first, then e.g.
+//   TransportBench --messages 20000 --chat-bytes 64 --file-mb 256
+// --corrupt-every N flips a byte in every Nth upload send to check that the server asks for those chunks again.
+#define WIN32_LEAN_AND_MEAN
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include "../Client/ClientProtocol.h"
+
+using namespace std;
+
+struct BenchConfig {
+    int port = 55555;
+    int messages = 20000;
+    int warmupMessages = 1000;
+    int chatBytes = 64;
+    int fileMegabytes = 64;
+    //Corrupt one in this many upload sends (0 = never)
+    int corruptEvery = 0;
+    string transport = "both";
+};
+
+struct TransportResult {
+    string name;
+    vector<double> latenciesUs;
+    double messagesPerSecond = 0;
+    double uploadMegabytesPerSecond = 0;
+    int corruptedSends = 0;
+};
+
+template<typename Transport>
+static bool request(Transport& transport, const char* command) {
+    char recieveConf[32];
+    return transport.SendAll(command, static_cast<int>(strlen(command))) && transport.RecvAll(recieveConf, 32);
+}
+
+//One CHAT after the other, timed from the request until the server confirmed the message
+template<typename Transport>
+static bool runChats(Transport& transport, const BenchConfig& config, uint64_t secret, TransportResult& result) {
+    vector<char> frame(sizeof(uint32_t) + config.chatBytes);
+    char recieveConf[32];
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < config.warmupMessages + config.messages; i++) {
+        if (i == config.warmupMessages) {
+            start = chrono::steady_clock::now();
+        }
+        char* message = frame.data() + sizeof(uint32_t);
+        memset(message, 'x', config.chatBytes - 1);
+        message[config.chatBytes - 1] = '\0';
+        int frameBytes = buildChatFrame(frame.data(), config.chatBytes, secret);
+
+        auto sent = chrono::steady_clock::now();
+        if (!request(transport, "CHAT") || !transport.SendAll(frame.data(), frameBytes) ||
+            !transport.RecvAll(recieveConf, sizeof(recieveConf))) {
+            return false;
+        }
+        if (i >= config.warmupMessages) {
+            chrono::duration<double, micro> latency = chrono::steady_clock::now() - sent;
+            result.latenciesUs.push_back(latency.count());
+        }
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    result.messagesPerSecond = config.messages / elapsed.count();
+    return true;
+}
+
+//One SEND of fileMegabytes, checksummed, encrypted and handed over 64 chunks at a time like the other clients
+template<typename Transport>
+static bool runUpload(Transport& transport, const BenchConfig& config, uint64_t secret, TransportResult& result) {
+    streamoff fileSize = static_cast<streamoff>(config.fileMegabytes) * 1024 * 1024;
+    vector<char> plainChunk(CHUNK_SIZE);
+    for (int i = 0; i < CHUNK_SIZE; i++) {
+        plainChunk[i] = static_cast<char>(i);
+    }
+    auto readChunk = [&](uint32_t index, char* chunkBuffer) {
+        int chunkBytes = static_cast<int>(min<streamoff>(fileSize - static_cast<streamoff>(index) * CHUNK_SIZE, CHUNK_SIZE));
+        memcpy(chunkBuffer, plainChunk.data(), chunkBytes);
+        return chunkBytes;
+    };
+
+    char header[FILE_HEADER_SIZE];
+    buildFileHeader(header, fileSize, "bin");
+    auto start = chrono::steady_clock::now();
+    if (!request(transport, "SEND") || !transport.SendAll(header, sizeof(header))) {
+        return false;
+    }
+
+    CorruptingTransport<Transport> uploadTransport{ transport, config.corruptEvery };
+    char recieveConf[32];
+    if (!sendFileBody(uploadTransport, fileSize, readChunk, secret) ||
+        !transport.RecvAll(recieveConf, sizeof(recieveConf))) {
+        return false;
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    result.uploadMegabytesPerSecond = config.fileMegabytes / elapsed.count();
+    result.corruptedSends = uploadTransport.corrupted;
+    if (strcmp(recieveConf, "Received file confirmation") != 0) {
+        cout << result.name << " upload rejected: " << recieveConf << endl;
+        return false;
+    }
+    return true;
+}
+
+template<typename Transport>
+static bool runWorkload(Transport& transport, const BenchConfig& config, uint64_t secret, TransportResult& result) {
+    if (!runChats(transport, config, secret, result) || !runUpload(transport, config, secret, result)) {
+        cout << result.name << " session failed " << WSAGetLastError() << endl;
+        return false;
+    }
+    return request(transport, "STOP");
+}
+
+static bool runTransport(const BenchConfig& config, bool sharedMemory, TransportResult& result) {
+    result.name = sharedMemory ? "shm" : "tcp";
+    uint64_t secret;
+    SOCKET clientSocket = connectToServer(config.port);
+    if (clientSocket == INVALID_SOCKET || !clientHandshake(clientSocket, secret)) {
+        cout << "Can't connect to the server " << WSAGetLastError() << endl;
+        return false;
+    }
+
+    bool completed;
+    if (sharedMemory) {
+        ShmSegment segment;
+        if (!openSharedMemory(clientSocket, segment)) {
+            cout << "Server refused the shared memory transport" << endl;
+            closesocket(clientSocket);
+            return false;
+        }
+        ShmTransport transport{ segment, clientSocket };
+        completed = runWorkload(transport, config, secret, result);
+    }
+    else {
+        SocketTransport transport{ clientSocket };
+        completed = runWorkload(transport, config, secret, result);
+    }
+    closesocket(clientSocket);
+    return completed;
+}
+
+static double percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+int main(int argc, char* argv[])
+{
+    BenchConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--port") == 0) config.port = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--messages") == 0) config.messages = max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "--warmup-messages") == 0) config.warmupMessages = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--chat-bytes") == 0) config.chatBytes = max(1, atoi(argv[i + 1]));
+        else if (strcmp(argv[i], "--file-mb") == 0) config.fileMegabytes = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--transport") == 0) config.transport = argv[i + 1];
+        else if (strcmp(argv[i], "--corrupt-every") == 0) config.corruptEvery = atoi(argv[i + 1]);
+    }
+    config.chatBytes = min(config.chatBytes, MAX_BUFFER);
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cout << "Winsock dll not found" << endl;
+        return 0;
+    }
+    srand(time(0));
+
+    vector<TransportResult> results;
+    for (bool sharedMemory : { false, true }) {
+        if (config.transport != "both" && config.transport != (sharedMemory ? "shm" : "tcp")) {
+            continue;
+        }
+        TransportResult result;
+        if (runTransport(config, sharedMemory, result)) {
+            sort(result.latenciesUs.begin(), result.latenciesUs.end());
+            results.push_back(result);
+        }
+    }
+
+    cout << config.messages << " CHAT messages of " << config.chatBytes << " bytes, one " << config.fileMegabytes
+        << " MB SEND" << endl;
+    cout << left << setw(10) << "transport" << right << setw(12) << "p50 us" << setw(12) << "p99 us"
+        << setw(12) << "max us" << setw(12) << "msgs/s" << setw(14) << "upload MB/s" << endl;
+    for (const TransportResult& result : results) {
+        cout << left << setw(10) << result.name << right << fixed << setprecision(1)
+            << setw(12) << percentile(result.latenciesUs, 50) << setw(12) << percentile(result.latenciesUs, 99)
+            << setw(12) << result.latenciesUs.back() << setw(12) << result.messagesPerSecond
+            << setw(14) << result.uploadMegabytesPerSecond << endl;
+        if (result.corruptedSends > 0) {
+            cout << "  " << result.corruptedSends << " corrupted upload sends repaired by retransmits" << endl;
+        }
+    }
+    if (results.size() == 2) {
+        cout << "shm vs tcp: p50 latency x" << percentile(results[0].latenciesUs, 50) / percentile(results[1].latenciesUs, 50)
+            << " lower, msgs/s x" << results[1].messagesPerSecond / results[0].messagesPerSecond
+            << ", upload x" << results[1].uploadMegabytesPerSecond / results[0].uploadMegabytesPerSecond << endl;
+    }
+
+    WSACleanup();
+    return 0;
+}